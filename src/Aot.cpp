@@ -0,0 +1,333 @@
+#include "Global.h"
+#include "Aot.h"
+#include "Context.h"
+#include "Environment.h"
+#include "Expression.h"
+#include "Error.h"
+#include "Stats.h"
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+namespace ml {
+namespace Aot {
+
+
+Writer::Writer (Context* c, Error& e)
+	: ctx(c), err_(e), indent_(1), locals_(0) {}
+
+int Writer::local ()
+{
+	int n = locals_++;
+	line() << "Value* v" << n << " = nullptr;";
+	line() << "Context::Root r" << n << "(v" << n << ");";
+	return n;
+}
+
+std::ostream& Writer::line ()
+{
+	body_ << "\n" << std::string(indent_, '\t');
+	return body_;
+}
+void Writer::open ()
+{
+	line() << "{";
+	indent_++;
+}
+void Writer::close ()
+{
+	indent_--;
+	line() << "}";
+}
+
+bool Writer::constant (std::string& out, Value* v)
+{
+	std::ostringstream ss;
+	ss << std::setprecision(17);
+
+	switch (Value::typeOf(v))
+	{
+	case Value::Type::Int:
+		if (Value::isImmediate(v))
+			ss << "Value::encodeInt(" << Value::intValue(v) << "LL)";
+		else
+		{
+			boxes_.push_back("Aot::boxInt(" + std::to_string(Value::intValue(v)) + "LL)");
+			ss << "b_[" << boxes_.size() - 1 << "]";
+		}
+		break;
+
+	case Value::Type::Real:
+	{
+		real_t n = Value::realValue(v);
+		std::ostringstream lit;
+
+		// the literal has to read back as the same number
+		if (!std::isfinite(n))
+			return false;
+		lit << std::setprecision(17) << n;
+		if (lit.str().find_first_of(".e") == std::string::npos)
+			lit << ".0";
+
+		if (Value::isImmediate(v))
+			ss << "Value::encodeReal(" << lit.str() << ")";
+		else
+		{
+			boxes_.push_back("Aot::boxReal(" + lit.str() + ")");
+			ss << "b_[" << boxes_.size() - 1 << "]";
+		}
+		break;
+	}
+
+	case Value::Type::Bool:
+		ss << "Value::encodeBool(" << (Value::boolValue(v) ? "true" : "false") << ")";
+		break;
+	case Value::Type::Void:
+		ss << "Value::encodeVoid()";
+		break;
+	default:
+		return false;
+	}
+
+	out = ss.str();
+	return true;
+}
+
+std::string Writer::global (const std::string& name)
+{
+	auto it = globalIndex_.find(name);
+	if (it == globalIndex_.end())
+	{
+		it = globalIndex_.insert({ name, int(globals_.size()) }).first;
+		globals_.push_back(name);
+	}
+	return "g_[" + std::to_string(it->second) + "]";
+}
+
+std::string Writer::quote (const std::string& s)
+{
+	std::ostringstream ss;
+	ss << '"';
+	for (char c : s)
+		if (c == '"' || c == '\\')
+			ss << '\\' << c;
+		else
+			ss << c;
+	ss << '"';
+	return ss.str();
+}
+
+const std::string* Writer::function (LambdaFuncData* fn) const
+{
+	auto it = functions_.find(fn);
+	return it == functions_.end() ? nullptr : &it->second;
+}
+
+bool Writer::unsupported (Expression* e)
+{
+	err_.die(e->span) << "cannot compile " << e->type() << " to C++";
+	return false;
+}
+
+bool Writer::write (std::ostream& os,
+		const std::vector<std::pair<Symbol, Value*>>& defs)
+{
+	std::vector<std::pair<Symbol, LambdaFuncData*>> funcs;
+
+	for (auto& def : defs)
+		if (Value::isType(def.second, Value::Type::LambdaFunc))
+		{
+			auto fn = def.second->lambda_;
+			functions_[fn] = "f" + std::to_string(funcs.size()) + "_";
+			funcs.push_back({ def.first, fn });
+		}
+
+	for (auto& f : funcs)
+	{
+		auto fn = f.second;
+
+		body_ << "\n// fn " << f.first.str();
+		for (auto& arg : fn->argNames)
+			body_ << " " << arg.str();
+		body_ << "\nstatic bool " << functions_[fn]
+		      << " (Value*& out, Context* ctx, Value** params, Error& err)\n{";
+
+		locals_ = 0;
+		int result = local();
+		if (!fn->body->emit(*this, result))
+			return false;
+		line() << "out = v" << result << ";";
+		line() << "return true;";
+		body_ << "\n}\n";
+	}
+
+	os << "// compiled by ml --emit-cpp; build against libml.a\n"
+	   << "#include \"ML.h\"\n"
+	   << "#include \"Aot.h\"\n"
+	   << "#include \"Operator.h\"\n"
+	   << "\n"
+	   << "namespace ml {\n"
+	   << "namespace {\n"
+	   << "\n"
+	   << "// definitions and builtins, and numbers too big for immediates\n"
+	   << "Value* g_[" << std::max<std::size_t>(globals_.size(), 1) << "];\n"
+	   << "Value* b_[" << std::max<std::size_t>(boxes_.size(), 1) << "];\n"
+	   << body_.str()
+	   << "\n"
+	   << "}\n"
+	   << "\n"
+	   << "bool Aot::load (Context* ctx, Error& err)\n"
+	   << "{";
+
+	for (auto& f : funcs)
+	{
+		auto fn = f.second;
+
+		os << "\n\tif (!Aot::define(ctx, " << quote(f.first.str()) << ", {";
+		for (std::size_t i = 0; i < fn->argNames.size(); i++)
+			os << (i ? ", " : " ") << quote(fn->argNames[i].str());
+		os << " }, {";
+		for (std::size_t i = 0; i < fn->strict.size(); i++)
+			os << (i ? ", " : " ") << (fn->strict[i] ? "true" : "false");
+		os << " }, &" << functions_[fn] << ", err))\n\t\treturn false;";
+	}
+	for (std::size_t i = 0; i < globals_.size(); i++)
+		os << "\n\tg_[" << i << "] = Aot::global(ctx, "
+		   << quote(globals_[i]) << ");";
+	for (std::size_t i = 0; i < boxes_.size(); i++)
+		os << "\n\tb_[" << i << "] = " << boxes_[i] << ";";
+
+	os << "\n\treturn true;\n"
+	   << "}\n"
+	   << "\n"
+	   << "}\n"
+	   << "\n"
+	   << "#ifndef ML_AOT_NO_MAIN\n"
+	   << "int main (int argc, char** argv)\n"
+	   << "{\n"
+	   << "\treturn ml::Aot::main(argc, argv, &ml::Aot::load);\n"
+	   << "}\n"
+	   << "#endif\n";
+	return true;
+}
+
+
+bool emit (const std::string& path,
+		const std::vector<std::pair<Symbol, Value*>>& defs,
+		Context* ctx, Error& err)
+{
+	Writer w(ctx, err);
+	std::ofstream os(path);
+
+	if (!os)
+	{
+		err.die() << "cannot open '" << path << "'";
+		return false;
+	}
+	return w.write(os, defs);
+}
+
+
+
+bool define (Context* ctx, const std::string& name,
+				const std::vector<std::string>& args,
+				const std::vector<bool>& strict, Body body, Error& err)
+{
+	LambdaFuncData data
+		{
+			std::vector<Symbol>(args.begin(), args.end()),
+			Exp::makeCompiled(body),
+			nullptr,
+			nullptr,
+			strict
+		};
+
+	if (!ctx->env()->add(name, ctx->makeFunction(data)))
+	{
+		err.die() << "cannot override existing '" << name << "'";
+		return false;
+	}
+	return true;
+}
+
+Value* global (Context* ctx, const std::string& name)
+{
+	Value* v;
+	if (!ctx->env()->get(v, name))
+		return nullptr;
+	return v;
+}
+
+Value* boxInt (int_t n)
+{
+	auto v = new Value(Value::Type::Int);
+	v->int_.value = n;
+	return v;
+}
+Value* boxReal (real_t n)
+{
+	auto v = new Value(Value::Type::Real);
+	v->real_.value = n;
+	return v;
+}
+
+bool lookup (Value*& out, Context* ctx, const std::string& name, Error& err)
+{
+	if (!ctx->env()->get(out, name))
+	{
+		err.die(ctx) << "could not find variable '" << name << "'";
+		return false;
+	}
+	return true;
+}
+
+int main (int argc, char** argv, bool (*loader) (Context*, Error&))
+{
+	Error err;
+	bool ok;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string opt(argv[i]);
+
+		if (opt == "--stats")
+			Stats::enabled = true;
+		else
+		{
+			std::cerr << "unknown option '" << opt << "'" << std::endl;
+			return -1;
+		}
+	}
+
+	{
+		Context ctx;
+		Value* mainFunc = nullptr;
+		Value* output = ctx.makeVoid();
+
+		ok = loader(&ctx, err);
+		if (ok && !ctx.env()->get(mainFunc, "main"))
+		{
+			err.die() << "no main function";
+			ok = false;
+		}
+		ok = ok && Value::eval(output, &ctx, mainFunc, err);
+
+		if (ok)
+			std::cout << "result: " << Value::str(output) << std::endl;
+	}
+
+	if (!ok)
+	{
+		err.dump();
+		return -1;
+	}
+	if (Stats::enabled)
+		Stats::dump(std::cerr);
+	return 0;
+}
+
+
+};
+};
@@ -0,0 +1,103 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <sstream>
+#include <unordered_map>
+#include "Value.h"
+#include "Symbol.h"
+
+namespace ml {
+
+class Context;
+class Error;
+class Expression;
+
+/*
+ * Ahead-of-time compilation of a program to C++ (--emit-cpp). Each
+ * top-level function becomes a C++ function that does what the tree
+ * walker would do for its linked and simplified body: thunks are made
+ * and forced in the same places, through the same runtime calls, so
+ * evaluation is just as lazy. What is left to do at startup is to
+ * define the functions; nothing is parsed or walked.
+ *
+ * The translation unit is built against the runtime (libml.a, every
+ * source but main.cpp) into an executable. Built with ML_AOT_NO_MAIN
+ * it has no main(), for linking into a shared library or another
+ * program, which calls Aot::load() on a Context of its own.
+ *
+ * Expressions write their own code (Expression::emit), through Writer.
+ */
+namespace Aot {
+
+	// a compiled function body, taking the arguments in place
+	typedef bool (*Body) (Value*& out, Context* ctx, Value** args, Error& err);
+
+	class Writer
+	{
+	public:
+		Writer (Context* c, Error& e);
+
+		// for constants made by generators
+		Context* ctx;
+
+		// a new local, rooted until the end of the current block;
+		// the code for it is "v<n>"
+		int local ();
+		// start a line of the body, indented to the current block
+		std::ostream& line ();
+		void open ();  // {
+		void close (); // }
+
+		// C++ expressions for Values known while compiling
+		bool constant (std::string& out, Value* v);
+		std::string global (const std::string& name);
+		// a string literal
+		std::string quote (const std::string& s);
+		// the function compiled for 'fn', if it has one
+		const std::string* function (LambdaFuncData* fn) const;
+
+		// fails, for expressions that can't be compiled
+		bool unsupported (Expression* e);
+
+		// the whole translation unit, for the top-level functions
+		// (and builtins) in 'defs'
+		bool write (std::ostream& os,
+				const std::vector<std::pair<Symbol, Value*>>& defs);
+	private:
+		Error& err_;
+		std::ostringstream body_;
+		int indent_;
+		int locals_;
+		std::vector<std::string> globals_, boxes_;
+		std::unordered_map<std::string, int> globalIndex_;
+		std::unordered_map<LambdaFuncData*, std::string> functions_;
+	};
+
+	// write 'defs' as C++ to the file 'path'
+	bool emit (const std::string& path,
+			const std::vector<std::pair<Symbol, Value*>>& defs,
+			Context* ctx, Error& err);
+
+
+	// used by the generated code:
+
+	// define a compiled function
+	bool define (Context* ctx, const std::string& name,
+					const std::vector<std::string>& args,
+					const std::vector<bool>& strict, Body body, Error& err);
+	// a definition that is already there
+	Value* global (Context* ctx, const std::string& name);
+	// a number that doesn't fit in an immediate, never collected
+	Value* boxInt (int_t n);
+	Value* boxReal (real_t n);
+	// a variable that was undefined when it was compiled
+	bool lookup (Value*& out, Context* ctx, const std::string& name,
+					Error& err);
+
+	// defines the program's functions; written by --emit-cpp
+	bool load (Context* ctx, Error& err);
+	// run the program's main after 'loader', as the interpreter would
+	int main (int argc, char** argv, bool (*loader) (Context*, Error&));
+};
+
+};
@@ -0,0 +1,554 @@
+#include "Global.h"
+#include "Bytecode.h"
+#include "Expression.h"
+#include "Context.h"
+#include "Environment.h"
+#include "Error.h"
+#include "Operator.h"
+#include "Jit.h"
+#include "Stats.h"
+#include <algorithm>
+
+namespace ml {
+namespace Bytecode {
+
+
+bool enabled = false;
+std::size_t stackLimit = 0;
+
+
+// number of operands following each opcode
+static const int operands[Op::NumOps] = {
+	1, 1, 2, 2, 1, 1, 1, 1, 0, 1, 1, 1, 1, 0
+};
+
+// an application whose value is returned as is becomes a tail call
+static void markTailCalls (Code& code)
+{
+	auto& ops = code.ops;
+
+	for (int i = 0, n = code.here(); i < n; i += 1 + operands[ops[i]])
+	{
+		if (ops[i] != Op::Apply)
+			continue;
+
+		int next = i + 2;
+		while (ops[next] == Op::Jump)
+			next = int(ops[next + 1]);
+
+		if (ops[next] == Op::Return)
+			ops[i] = Op::TailApply;
+	}
+}
+
+void compile (Code& code, Expression* body)
+{
+	code.ops.clear();
+	code.syms.clear();
+	code.depth = code.maxStack = 0;
+
+	body->compile(code);
+	code.emit(Op::Return);
+	markTailCalls(code);
+	code.compiled = true;
+}
+
+static Code& codeOf (LambdaFuncData* fn)
+{
+	auto& code = fn->code;
+	if (code == nullptr)
+		code = std::make_shared<Code>();
+	if (!code->compiled)
+		compile(*code, fn->body.get());
+	return *code;
+}
+
+
+
+static inline bool apply (Value*& out, Context* ctx,
+		Value* base, Value** args, int nargs, Error& err)
+{
+	for (int i = 0; i < nargs; i++)
+		if (!Value::trivialEval(args[i]))
+		{
+			out = ctx->apply(base, args, nargs);
+			return true;
+		}
+
+	// eager application when trivial, like ApplyExpression. the
+	// arguments need no forcing, so this does not nest
+	if (Value::isType(base, Value::Type::NativeFunc) &&
+			nargs == base->native_.nargs)
+		return base->apply(out, ctx, args, err);
+
+	out = ctx->apply(base, args, nargs);
+	return true;
+}
+
+
+
+/*
+ * Evaluates without nesting on the C++ stack. Everything that
+ * partialEval, Value::apply and the lambda bodies would keep in
+ * native frames is kept in 'frames' instead, with the Values they
+ * hold in 'vals':
+ *
+ *   Spine   [thunk][the arguments still to be applied, last one
+ *           first]; 'acc' holds the function being applied, and the
+ *           thunk (if any) is overwritten with the result
+ *   Native  [args...][func], while forcing the arguments
+ *   Code    [args...][func][operand stack], running a lambda body
+ *
+ * A frame that is done pops itself, leaving its result in 'acc'
+ * for the frame below.
+ */
+struct Machine
+{
+	struct Frame
+	{
+		enum class Kind { Spine, Native, Code };
+
+		Kind kind;
+		int base;     // where the frame starts in 'vals'
+		int nargs;
+		int next;     // Native: argument being forced, or -1
+		Code* code;
+		int pc, sp;   // Code: saved when the frame is left
+		bool pending; // Code: 'acc' is the condition it was forcing
+	};
+
+	Context* ctx;
+	Error& err;
+	std::vector<Frame> frames;
+	std::vector<Value*> vals;
+	Value* acc;
+	Context::Root valsRoot, accRoot;
+
+	Machine (Context* c, Error& e)
+		: ctx(c), err(e), acc(nullptr), valsRoot(vals), accRoot(acc) {}
+
+	bool run (Value*& out);
+	bool push (const Frame& f);
+	bool enter (int nargs);
+	bool force (Value* v);
+	bool spine ();
+	bool leave (int base);
+	bool native ();
+	bool code ();
+};
+
+
+bool Machine::run (Value*& out)
+{
+	while (!frames.empty())
+	{
+		bool ok;
+
+		switch (frames.back().kind)
+		{
+		case Frame::Kind::Spine: ok = spine(); break;
+		case Frame::Kind::Native: ok = native(); break;
+		default: ok = code(); break;
+		}
+
+		if (!ok)
+			return false;
+	}
+
+	out = acc;
+	return true;
+}
+
+bool Machine::push (const Frame& f)
+{
+	if (stackLimit > 0 && frames.size() >= stackLimit)
+	{
+		err.die(ctx) << "stack limit exceeded";
+		return false;
+	}
+	frames.push_back(f);
+	Stats::peak(Stats::framesHighWater, frames.size());
+	return true;
+}
+
+
+// call 'acc' with the last 'nargs' Values of the spine
+bool Machine::enter (int nargs)
+{
+	Value* func = acc;
+	int base = vals.size() - nargs;
+
+	// into calling order, and out of the spine
+	std::reverse(vals.begin() + base, vals.end());
+
+	// done already, as if the frame had returned
+	if (Value::typeOf(func) == Value::Type::LambdaFunc &&
+			Jit::call(acc, func, vals.data() + base))
+	{
+		vals.resize(base);
+		return true;
+	}
+	vals.push_back(func);
+
+	if (Value::typeOf(func) == Value::Type::NativeFunc)
+		return push({ Frame::Kind::Native, base, nargs, -1,
+						nullptr, 0, 0, false });
+
+	auto& code = codeOf(func->lambda_);
+	int sp = vals.size();
+	vals.resize(sp + code.maxStack, nullptr);
+
+	return push({ Frame::Kind::Code, base, nargs, 0,
+					&code, 0, sp, false });
+}
+
+
+bool Machine::spine ()
+{
+	int base = frames.back().base;
+
+	for (;;)
+	{
+		Context::safepoint();
+
+		int have = vals.size() - base - 1;
+
+		switch (Value::typeOf(acc))
+		{
+		case Value::Type::Indirect:
+			acc = acc->ind_;
+			break;
+
+		case Value::Type::PartialFunc:
+			if (have == 0 && !Value::trivialEval(acc))
+			{
+				// both thunks have the same value, see partialEval
+				if (vals[base])
+					vals[base]->update(acc);
+				vals[base] = acc;
+			}
+
+			for (int i = acc->partial_.nargs; i-- > 0; )
+				vals.push_back(acc->partial_.args[i]);
+			acc = acc->partial_.base;
+			break;
+
+		case Value::Type::LambdaFunc:
+		case Value::Type::NativeFunc:
+		{
+			int nargs = Value::numArgs(acc);
+
+			if (have >= nargs)
+				return enter(nargs);
+
+			// create partial application
+			std::reverse(vals.begin() + base + 1, vals.end());
+			acc = ctx->apply(acc, vals.data() + base + 1, have);
+			return leave(base);
+		}
+
+		default:
+			if (have > 0)
+			{
+				err.die(ctx) << "cannot apply value " << Value::str(acc);
+				return false;
+			}
+			return leave(base);
+		}
+	}
+}
+
+// done with the spine frame at 'base', with the result in 'acc'
+bool Machine::leave (int base)
+{
+	if (vals[base])
+		vals[base]->update(acc);
+	vals.resize(base);
+	frames.pop_back();
+	return true;
+}
+
+// evaluate 'v' in a frame of its own
+bool Machine::force (Value* v)
+{
+	acc = v;
+	vals.push_back(nullptr);
+	return push({ Frame::Kind::Spine, int(vals.size()) - 1, 0, 0,
+					nullptr, 0, 0, false });
+}
+
+
+bool Machine::native ()
+{
+	auto& f = frames.back();
+	Value** args = vals.data() + f.base;
+	Value* func = args[f.nargs];
+
+	if (f.next >= 0)
+		args[f.next] = acc;
+	else
+		f.next = 0;
+
+	for (; f.next < f.nargs; f.next++)
+	{
+		int i = f.next;
+
+		if (!Value::trivialEval(args[i]))
+		{
+			return force(args[i]);
+		}
+		args[i] = Value::deref(args[i]);
+
+		if (!Value::isType(args[i], func->native_.types[i]))
+		{
+			err.die(ctx) << "invalid argument #" << (i + 1) << " to function '"
+				         << *func->native_.name << "', expected "
+						 << Value::str(func->native_.types[i]);
+			return false;
+		}
+	}
+
+	if (!func->native_.handler(acc, ctx, args, err))
+		return false;
+
+	vals.resize(f.base);
+	frames.pop_back();
+	return true;
+}
+
+
+bool Machine::code ()
+{
+	auto& f = frames.back();
+	Value** args = vals.data() + f.base;
+	auto fn = args[f.nargs]->lambda_;
+	Environment* outer = fn->env ? fn->env->env_ : nullptr;
+	const word* ops = f.code->ops.data();
+	const word* pc = ops + f.pc;
+	Value** sp = vals.data() + f.sp;
+	Value* v;
+	int nargs;
+
+	if (f.pending)
+	{
+		*sp++ = acc;
+		f.pending = false;
+	}
+
+	// for the odd instruction that needs the frame as an environment
+#define FRAME_CONTEXT(sub) \
+	Environment frameEnv(fn->env, fn->argNames, args); \
+	Context sub(&frameEnv)
+
+#ifdef ML_COMPUTED_GOTO
+	static void* const labels[] = {
+		&&op_Const, &&op_Local, &&op_Upvalue, &&op_Name, &&op_Eval,
+		&&op_Apply, &&op_TailApply, &&op_Call, &&op_Force,
+		&&op_Arith, &&op_ArithInt, &&op_JumpIfNot, &&op_Jump,
+		&&op_Return
+	};
+	static_assert(sizeof(labels) / sizeof(labels[0]) == Op::NumOps,
+			"missing opcode label");
+# define CASE(op)		op_##op:
+# define NEXT()			goto *labels[*pc++]
+	NEXT();
+#else
+# define CASE(op)		case Op::op:
+# define NEXT()			continue
+	for (;;)
+	switch (*pc++)
+	{
+#endif
+
+	CASE(Const)
+		*sp++ = (Value*) pc[0];
+		pc += 1;
+		NEXT();
+
+	CASE(Local)
+		*sp++ = args[pc[0]];
+		pc += 1;
+		NEXT();
+
+	CASE(Upvalue)
+		*sp++ = outer->ancestor(pc[0] - 1)->slot(pc[1]);
+		pc += 2;
+		NEXT();
+
+	CASE(Name)
+	{
+		const Symbol& name = f.code->syms[pc[1]];
+		bool found;
+
+		if (pc[0] > 0)
+			found = outer->ancestor(pc[0] - 1)->get(v, name);
+		else
+		{
+			FRAME_CONTEXT(sub);
+			found = frameEnv.get(v, name);
+		}
+
+		if (!found)
+		{
+			err.die(ctx) << "could not find variable '" << name.str() << "'";
+			return false;
+		}
+		*sp++ = v;
+		pc += 2;
+		NEXT();
+	}
+
+	CASE(Eval)
+	{
+		// the tree walker may nest, but not into this machine
+		FRAME_CONTEXT(sub);
+		if (!((Expression*) pc[0])->eval(v, &sub, err))
+			return false;
+		*sp++ = v;
+		pc += 1;
+		NEXT();
+	}
+
+	CASE(TailApply)
+		nargs = int(pc[0]);
+		v = sp[-nargs - 1];
+
+		// reuse the frame; the caller would apply the result right
+		// away anyway
+		if (Value::isType(v, Value::Type::LambdaFunc) &&
+				Value::numArgs(v) == nargs)
+		{
+			// back into spine order, as enter() expects
+			for (int i = 0; i < nargs; i++)
+				args[i] = sp[-1 - i];
+
+			acc = v;
+			vals.resize(f.base + nargs);
+			frames.pop_back();
+			Context::safepoint();
+			return enter(nargs);
+		}
+		// fall through
+
+	CASE(Apply)
+		nargs = int(pc[0]);
+		sp -= nargs;
+
+		if (!apply(v, ctx, sp[-1], sp, nargs, err))
+			return false;
+
+		sp[-1] = v;
+		pc += 1;
+		NEXT();
+
+	CASE(Call)
+	{
+		nargs = int(pc[0]);
+		sp -= nargs + 1;
+		f.pc = (pc + 1) - ops;
+		f.sp = sp - vals.data();
+		f.pending = true;
+
+		// a spine frame of its own, as if forcing the thunk that
+		// Apply would have made
+		int base = vals.size();
+		vals.push_back(nullptr);
+		for (int i = nargs; i > 0; i--)
+			vals.push_back(vals[f.sp + i]);
+		acc = vals[f.sp];
+		return push({ Frame::Kind::Spine, base, 0, 0,
+						nullptr, 0, 0, false });
+	}
+
+	CASE(Force)
+		if (!Value::trivialEval(sp[-1]))
+		{
+			v = *--sp;
+			f.pc = (pc - 1) - ops;
+			f.sp = sp - vals.data();
+			f.pending = true;
+			return force(v);
+		}
+		sp[-1] = Value::deref(sp[-1]);
+		NEXT();
+
+	CASE(Arith)
+		sp -= 2;
+		if (!Operator::eval(v, ctx, Operator::Kind(pc[0]),
+				Value::deref(sp[0]), Value::deref(sp[1])) &&
+			!apply(v, ctx, sp[-1], sp, 2, err))
+			return false;
+
+		sp[-1] = v;
+		pc += 1;
+		NEXT();
+
+	CASE(ArithInt)
+		sp -= 2;
+		if (!(Value::isImmediate(sp[0]) && Value::isImmediate(sp[1]) &&
+				Operator::evalInt(v, ctx, Operator::Kind(pc[0]),
+					Value::intValue(sp[0]), Value::intValue(sp[1]))) &&
+			!apply(v, ctx, sp[-1], sp, 2, err))
+			return false;
+
+		sp[-1] = v;
+		pc += 1;
+		NEXT();
+
+	CASE(JumpIfNot)
+		if (!Value::trivialEval(sp[-1]))
+		{
+			// force it in a frame of its own, then come back here
+			v = *--sp;
+			f.pc = (pc - 1) - ops;
+			f.sp = sp - vals.data();
+			f.pending = true;
+			return force(v);
+		}
+		sp--;
+		if (Value::condition(*sp))
+			pc += 1;
+		else
+			pc = ops + pc[0];
+		NEXT();
+
+	CASE(Jump)
+		pc = ops + pc[0];
+		NEXT();
+
+	CASE(Return)
+		acc = sp[-1];
+		vals.resize(f.base);
+		frames.pop_back();
+		return true;
+
+#ifndef ML_COMPUTED_GOTO
+	}
+#endif
+#undef CASE
+#undef NEXT
+#undef FRAME_CONTEXT
+}
+
+
+
+bool eval (Value*& out, Context* ctx, Value* v, Error& err)
+{
+	Machine m(ctx, err);
+	return m.force(v) && m.run(out);
+}
+
+bool call (Value*& out, Context* ctx, Value* func, Value** args, Error& err)
+{
+	Machine m(ctx, err);
+	int nargs = Value::numArgs(func);
+
+	m.acc = func;
+	m.vals.assign(args, args + nargs);
+	std::reverse(m.vals.begin(), m.vals.end());
+	return m.enter(nargs) && m.run(out);
+}
+
+
+};
+};
@@ -0,0 +1,91 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "Value.h"
+#include "Symbol.h"
+
+namespace ml {
+
+class Expression;
+
+/*
+ * Lambda bodies compiled to a flat sequence of words, for the
+ * virtual machine in Bytecode.cpp. Each instruction is an opcode
+ * followed by its operands. Evaluation is the same as the tree
+ * walker's: applications build partial applications unless they
+ * can call a native function right away, and only conditions and
+ * what strictness analysis found to be forced anyway are forced.
+ *
+ * Expressions that don't know how to compile themselves are
+ * evaluated through the tree walker (Op::Eval).
+ */
+namespace Bytecode {
+
+	using word = std::intptr_t;
+
+	enum Op : word
+	{
+		Const,    // <Value*>            push constant
+		Local,    // <slot>              push argument of this frame
+		Upvalue,  // <depth> <slot>      push argument of an outer frame
+		Name,     // <depth> <symbol>    push variable looked up by name
+		Eval,     // <Expression*>       push result of tree walker
+		Apply,    // <nargs>             apply base to nargs arguments
+		TailApply,// <nargs>             same, in tail position
+		Call,     // <nargs>             same, forcing the result
+		Force,    //                     force the top of the stack
+		Arith,    // <operator>          Apply 2 for a builtin operator
+		ArithInt, // <operator>          same, typed as Ints
+		JumpIfNot,// <target>            pop and branch on condition
+		Jump,     // <target>
+		Return,
+
+		NumOps
+	};
+
+	struct Code
+	{
+		inline Code ()
+			: compiled(false), depth(0), maxStack(0) {}
+
+		std::vector<word> ops;
+		std::vector<Symbol> syms;
+		bool compiled;
+
+		// stack depth while compiling
+		int depth;
+		int maxStack;
+
+		inline int here () const { return int(ops.size()); }
+		inline void emit (word w) { ops.push_back(w); }
+		inline void push (int n = 1)
+		{
+			depth += n;
+			if (depth > maxStack)
+				maxStack = depth;
+		}
+		inline void pop (int n = 1) { depth -= n; }
+	};
+
+	// use the virtual machine instead of the tree walker
+	extern bool enabled;
+	// most frames the machine may have at once, 0 for no limit
+	extern std::size_t stackLimit;
+
+	void compile (Code& code, Expression* body);
+
+	/*
+	 * The machine keeps its frames on the heap, so neither forcing
+	 * nor calling nests on the C++ stack, however deep the program
+	 * recurses. Calls in tail position that saturate a lambda reuse
+	 * the frame, so loops written as recursion run in constant space.
+	 */
+	// same as Value::partialEval
+	bool eval (Value*& out, Context* ctx, Value* v, Error& err);
+	// call a lambda with as many arguments as it takes
+	bool call (Value*& out, Context* ctx, Value* func, Value** args,
+					Error& err);
+};
+
+};
@@ -2,61 +2,58 @@
 #include "Global.h"
 #include "Environment.h"
 #include "ValueAllocator.h"
+#include "Stats.h"
+#include "left_vector.hpp"
 
 
 namespace ml {
 
 
-#ifdef ML_USE_CUSTOM_ALLOCATOR
 ValueAllocator* Context::allocator;
-#endif
-Value* Context::true_ = nullptr;
-Value* Context::false_ = nullptr;
-Value* Context::void_ = nullptr;
+Context* Context::contexts_ = nullptr;
+Context::Root* Context::roots_ = nullptr;
+std::vector<Value*> Context::remembered_;
 
 
-#ifdef ML_USE_CUSTOM_ALLOCATOR
-# define CREATE_VALUE		allocator->alloc
-#else
-# define CREATE_VALUE		new Value
-#endif
+#define CREATE_VALUE		allocator->alloc
 
 
 Context::Context (Value* parentEnv)
 {
-#ifdef ML_USE_CUSTOM_ALLOCATOR
 	if (!allocator)
 	{
 		allocator = new ValueAllocator();
 		MLdebug("using custom allocator");
 	}
-#endif
 
-	envVal_ = CREATE_VALUE(Value::Type::Environment, this);
+	link_();
+	envVal_ = CREATE_VALUE(Value::Type::Environment);
 	envVal_->env_ = new Environment(parentEnv);
-	take_(envVal_);
 }
-Context::~Context ()
+Context::Context (Environment* frame)
+	: frameVal_(Value::Type::Environment)
 {
-	purge();
+	// not managed by the allocator, so it goes away with the context
+	link_();
+	frameVal_.env_ = frame;
+	envVal_ = &frameVal_;
 }
-
-
-Value* Context::take_ (Value* val)
+void Context::link_ ()
 {
-	owned_.push_front(val);
-	return val;
+	prev_ = nullptr;
+	next_ = contexts_;
+	if (contexts_)
+		contexts_->prev_ = this;
+	contexts_ = this;
 }
-int Context::purge ()
+Context::~Context ()
 {
-	int p = 0;
-	for (auto v : owned_)
-	{
-		p++;
-		v->destroy();
-	}
-	owned_.clear();
-	return p;
+	if (prev_)
+		prev_->next_ = next_;
+	else
+		contexts_ = next_;
+	if (next_)
+		next_->prev_ = prev_;
 }
 
 
@@ -66,46 +63,52 @@ int Context::purge ()
 
 Value* Context::makeInt (int_t t)
 {
-	auto v = CREATE_VALUE(Value::Type::Int, this);
-	v->int_.value = t;	
-	return take_(v);
+	if (auto imm = Value::encodeInt(t))
+		return imm;
+
+	auto v = CREATE_VALUE(Value::Type::Int);
+	v->int_.value = t;
+	return v;
 }
 Value* Context::makeReal (real_t t)
 {
-	auto v = CREATE_VALUE(Value::Type::Real, this);
-	v->real_.value = t;	
-	return take_(v);
+	if (auto imm = Value::encodeReal(t))
+		return imm;
+
+	auto v = CREATE_VALUE(Value::Type::Real);
+	v->real_.value = t;
+	return v;
 }
-Value* Context::makeFunction (const std::string& name, 
+Value* Context::makeFunction (const std::string& name,
 				const std::vector<Value::Type>& types, Value::FuncHandler handler)
 {
-	auto v = CREATE_VALUE(Value::Type::NativeFunc, this);
+	auto v = CREATE_VALUE(Value::Type::NativeFunc);
 	int nargs = types.size();
-	v->native_ = {	nargs, 
+	v->native_ = {	nargs,
 					handler,
 					nargs ? new Value::Type[nargs] : nullptr,
 					new std::string(name) };
 	for (int i = 0; i < nargs; i++)
 		v->native_.types[i] = types[i];
-	return take_(v);
+	return v;
 }
 Value* Context::makeFunction (const LambdaFuncData& data)
 {
-	auto v = CREATE_VALUE(Value::Type::LambdaFunc, this);
+	auto v = CREATE_VALUE(Value::Type::LambdaFunc);
 	v->lambda_ = new LambdaFuncData(data);
 	v->lambda_->env = envVal_;
-	return take_(v);
+	return v;
 }
 Value* Context::apply (Value* func, const std::vector<Value*>& args)
 {
 	return apply(func, (Value**) args.data(), args.size());
 }
-Value* Context::apply (Value* func, Value** args, int nargs) 
+Value* Context::apply (Value* func, Value** args, int nargs)
 {
 	if (nargs == 0)
 		return func;
 
-	auto v = CREATE_VALUE(Value::Type::PartialFunc, this);
+	auto v = CREATE_VALUE(Value::Type::PartialFunc);
 	v->partial_.base = func;
 	v->partial_.nargs = nargs;
 	v->partial_.args = new Value*[nargs];
@@ -113,87 +116,197 @@ Value* Context::apply (Value* func, Value** args, int nargs)
 	for (int i = 0; i < nargs; i++)
 		v->partial_.args[i] = args[i];
 
-	return take_(v);
+	return v;
 }
 Value* Context::makeTrue ()
 {
-	if (!true_)
-	{
-		true_ = CREATE_VALUE(Value::Type::Bool);
-		true_->bool_ = true;
-	}
-	return true_;
+	return Value::encodeBool(true);
 }
 Value* Context::makeFalse ()
 {
-	if (!false_)
-	{
-		false_ = CREATE_VALUE(Value::Type::Bool);
-		false_->bool_ = false;
-	}
-	return false_;
+	return Value::encodeBool(false);
 }
 Value* Context::makeVoid ()
 {
-	if (!void_)
-		void_ = CREATE_VALUE(Value::Type::Void);
-
-	return void_;
+	return Value::encodeVoid();
 }
 
 
 
 
-void Context::takeControl (Value* val, Context* old)
+Context::Root::Root (Kind k, void* p, int len)
+	: prev_(roots_), kind_(k), ptr_(p), len_(len)
+{
+	roots_ = this;
+}
+Context::Root::Root (Value*& val)
+	: Root(Kind::Single, &val) {}
+Context::Root::Root (Value** vals, int len)
+	: Root(Kind::Array, vals, len) {}
+Context::Root::Root (std::vector<Value*>& vals)
+	: Root(Kind::Vector, &vals) {}
+Context::Root::Root (left_vector<Value*>& vals)
+	: Root(Kind::LeftVector, &vals) {}
+Context::Root::~Root ()
 {
-	// avoid taking globals or null or malformed commands
-	if (val == nullptr || old == nullptr || old == this)
-		return;
+	roots_ = prev_;
+}
 
-	// only take what you are meant to take!!
-	if (val->owner != old)
-		return;
 
-	
-	old->loseControl(val);
-	
-	take_(val)->owner = this;
+struct Context::Marker
+{
+	bool full; // minor collections leave old Values alone
+	std::vector<Value*> stack;
+	std::vector<Value*> unmanaged;
 
-	if (val->type == Value::Type::Environment)
+	inline void mark (Value* v)
 	{
-		// iterate keys
-		for (Value* v : *val->env_)
-			takeControl(v, old);
-		takeControl(val->env_->parentValue(), old);
+		if (v != nullptr && !Value::isImmediate(v) &&
+				!v->marked && (full || !v->old))
+		{
+			v->marked = true;
+			stack.push_back(v);
+		}
 	}
-	if (val->type == Value::Type::PartialFunc)
+
+	inline void markEnv (Environment* env)
 	{
-		for (int i = 0; i < val->partial_.nargs; i++)
-			takeControl(val->partial_.args[i], old);
+		for (Value* u : *env)
+			mark(u);
+		mark(env->parentValue());
 	}
-}
-void Context::loseControl (Value* val)
+
+	void markChildren (Value* v)
+	{
+		switch (v->type)
+		{
+		case Value::Type::Environment:
+			markEnv(v->env_);
+			break;
+
+		case Value::Type::PartialFunc:
+			mark(v->partial_.base);
+			for (int i = 0; i < v->partial_.nargs; i++)
+				mark(v->partial_.args[i]);
+			break;
+
+		case Value::Type::LambdaFunc:
+			mark(v->lambda_->env);
+			break;
+
+		case Value::Type::Indirect:
+			// skip the rest of the chain, so that the thunks in
+			// between can go
+			v->ind_ = Value::deref(v->ind_);
+			mark(v->ind_);
+			break;
+
+		default: break;
+		}
+	}
+
+	void trace ()
+	{
+		while (!stack.empty())
+		{
+			Value* v = stack.back();
+			stack.pop_back();
+
+			// not ours to sweep, but the mark still has to be undone
+			if (v->allocator == nullptr)
+				unmanaged.push_back(v);
+
+			markChildren(v);
+		}
+	}
+
+	void finish ()
+	{
+		for (auto v : unmanaged)
+			v->marked = false;
+	}
+};
+
+
+void Context::markRoots_ (Marker& m)
 {
-	val->owner = nullptr;
-	owned_.remove(val);
-}
+	for (auto c = contexts_; c; c = c->next_)
+	{
+		m.mark(c->envVal_);
 
+		// live environments are still being added to, so they may
+		// point at young ones, just like updated thunks
+		if (!m.full)
+			m.markEnv(c->env());
+	}
+
+	if (!m.full)
+		for (auto v : remembered_)
+			m.markChildren(v);
+
+	for (auto r = roots_; r; r = r->prev_)
+		switch (r->kind_)
+		{
+		case Root::Kind::Single:
+			m.mark(*(Value**) r->ptr_);
+			break;
+
+		case Root::Kind::Array:
+			for (int i = 0; i < r->len_; i++)
+				m.mark(((Value**) r->ptr_)[i]);
+			break;
+
+		case Root::Kind::Vector:
+			for (auto v : *(std::vector<Value*>*) r->ptr_)
+				m.mark(v);
+			break;
+
+		case Root::Kind::LeftVector:
+			for (auto v : *(left_vector<Value*>*) r->ptr_)
+				m.mark(v);
+			break;
+		}
+}
 
 
 void Context::collectGarbage (const std::vector<Value*>& keep)
 {
-	Context dummy;
-	for (auto& v : keep)
-		dummy.takeControl(v, this);
-	dummy.takeControl(envVal_, this);
-
-	purge(); //  :O !!!
+	Marker m;
+	m.full = true;
+	Stats::collections++;
+
+	for (auto v : keep)
+		m.mark(v);
+	markRoots_(m);
+	m.trace();
+
+	allocator->sweep();
+	m.finish();
+	remembered_.clear();
+}
 
-	takeControl(envVal_, &dummy);
-	for (auto& v : keep)
-		takeControl(v, &dummy);
+void Context::collectYoung ()
+{
+	Marker m;
+	m.full = false;
+	Stats::collections++;
+	Stats::youngCollections++;
+
+	markRoots_(m);
+	m.trace();
+
+	allocator->sweepYoung();
+	m.finish();
+	// everything they pointed to is old now
+	remembered_.clear();
+}
 
-	// dummy.~Context();
+void Context::safepoint ()
+{
+	if (allocator->wantsCollect())
+		collectGarbage();
+	else if (allocator->wantsCollectYoung())
+		collectYoung();
 }
 
 
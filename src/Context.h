@@ -1,8 +1,9 @@
 #pragma once
-#include <list>
 #include <vector>
 #include "Value.h"
 
+template <typename T> class left_vector;
+
 namespace ml {
 
 class Environment;
@@ -13,10 +14,22 @@ public:
 	Context (Value* parentEnv = nullptr);
 	inline Context (Context* parent)
 		: Context(parent->envValue()) {}
+	// a call frame, which borrows 'frame' as its environment instead
+	// of allocating one. nothing outlives the call that could point
+	// back into the frame (lambdas are only made at the top level)
+	explicit Context (Environment* frame);
 	~Context ();
-	
-	void collectGarbage (const std::vector<Value*>& keep);
-	int purge ();
+
+	// mark everything reachable from the live contexts and roots
+	// (plus 'keep'), then sweep the rest
+	static void collectGarbage (const std::vector<Value*>& keep = {});
+	// same, but only for the Values allocated since the last collection
+	static void collectYoung ();
+	// collect if enough has been allocated since the last time
+	static void safepoint ();
+	// write barrier, for old Values that were made to point
+	// at (possibly) young ones
+	static inline void remember (Value* v) { remembered_.push_back(v); }
 
 	Value* makeTrue ();
 	Value* makeFalse ();
@@ -24,7 +37,7 @@ public:
 	inline Value* makeBool (bool t) { return t ? makeTrue() : makeFalse(); }
 	// make numbers
 	Value* makeInt (int_t t);
-	Value* makeReal (real_t n);	
+	Value* makeReal (real_t n);
 
 	// make native function
 	Value* makeFunction (const std::string& name,
@@ -36,27 +49,54 @@ public:
 
 	// make partial application
 	Value* apply (Value* func, const std::vector<Value*>& args);
-	Value* apply (Value* func, Value** args, int nargs); 
-	
+	Value* apply (Value* func, Value** args, int nargs);
 
 
-	void loseControl (Value* val);
-	void takeControl (Value* val, Context* old);
-	inline void takeControl (Value* val) { takeControl(val, val->owner); }
-	
 	inline Environment* env () { return envVal_->env_; }
 	inline Value* envValue () { return envVal_; }
+
+
+	/*
+	 * Registers Values held by C++ locals as garbage collector
+	 * roots for as long as the Root is in scope. Roots must be
+	 * destroyed in reverse order of creation.
+	 */
+	class Root
+	{
+	public:
+		Root (Value*& val);
+		Root (Value** vals, int len); // null entries are skipped
+		Root (std::vector<Value*>& vals);
+		Root (left_vector<Value*>& vals);
+		~Root ();
+	private:
+		friend class Context;
+		enum class Kind { Single, Array, Vector, LeftVector };
+
+		Root (Kind k, void* p, int len = 0);
+
+		Root* prev_;
+		Kind kind_;
+		void* ptr_;
+		int len_;
+	};
+
 private:
-#ifdef ML_USE_CUSTOM_ALLOCATOR
+	struct Marker;
+	static void markRoots_ (Marker& m);
+
 	static ValueAllocator* allocator;
-#endif
-	static Value* true_;
-	static Value* false_;
-	static Value* void_;
-
-	std::list<Value*> owned_;
-	Value* envVal_;	
-	Value* take_ (Value* v);
+
+	// all live contexts, for the collector
+	static Context* contexts_;
+	static Root* roots_;
+	static std::vector<Value*> remembered_;
+	Context* prev_;
+	Context* next_;
+	void link_ ();
+
+	Value* envVal_;
+	Value frameVal_; // envVal_ for call frames
 };
 
 };
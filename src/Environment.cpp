@@ -9,39 +9,60 @@ namespace ml {
 
 
 Environment::Environment (Value* parent)
-	: parent_(parent)
+	: parent_(parent), names_(nullptr), vals_(nullptr)
+{ }
+Environment::Environment (Value* parent,
+		const std::vector<Symbol>& names, Value** vals)
+	: parent_(parent), names_(&names), vals_(vals)
 { }
 
-bool Environment::add (const std::string& name, Value* val)
+bool Environment::add (Symbol name, Value* val)
 {
-	if (data_.find(name) != data_.end())
+	// frames are fixed once created
+	if (names_ || data_.find(name) != data_.end())
 		return false;
 	
 	data_[name] = val;
 	return true;
 }
 
-bool Environment::get (Value*& out, const std::string& name)
+bool Environment::get (Value*& out, Symbol name)
 {
+	if (names_)
+	{
+		// few enough names that a scan beats hashing
+		for (std::size_t i = 0, n = names_->size(); i < n; i++)
+			if ((*names_)[i] == name)
+			{
+				out = vals_[i];
+				return true;
+			}
+
+		return getParent_(out, name);
+	}
+
 	auto it = data_.find(name);
 
 	if (it == data_.end())
-	{
-		if (parent_ == nullptr)
-		{
-			if (this == global())
-				return false;
-			else
-				return global()->get(out, name);
-		}
-		else
-			return parent_->env_->get(out, name);
-	}
+		return getParent_(out, name);
 	
 	out = it->second;
 	return true;
 }
 
+bool Environment::getParent_ (Value*& out, Symbol name)
+{
+	if (parent_ == nullptr)
+	{
+		if (this == global())
+			return false;
+		else
+			return global()->get(out, name);
+	}
+	else
+		return parent_->env_->get(out, name);
+}
+
 Environment* Environment::parent ()
 {
 	if (parent_ == nullptr)
@@ -50,5 +71,16 @@ Environment* Environment::parent ()
 		return parent_->env_;
 }
 
+Environment* Environment::ancestor (int depth)
+{
+	auto env = this;
+	for (; depth > 0; depth--)
+		if (env->parent_ == nullptr)
+			return global();
+		else
+			env = env->parent_->env_;
+	return env;
+}
+
 
 };
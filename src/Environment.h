@@ -10,35 +10,55 @@ namespace ml {
 class Environment
 {
 public:
-	using map_t = std::map<std::string, Value*>;
+	using map_t = std::unordered_map<Symbol, Value*, Symbol::Hash>;
 
 	static Environment* global ();
 	
 	Environment (Value* parent);
+	// a call frame, binding 'names' to 'vals' in place. neither is
+	// copied, so both have to outlive the environment
+	Environment (Value* parent, const std::vector<Symbol>& names,
+					Value** vals);
 	
-	bool add (const std::string& name, Value* val);
-	bool get (Value*& out, const std::string& name);
+	bool add (Symbol name, Value* val);
+	bool get (Value*& out, Symbol name);
 	
 	inline Value* parentValue () { return parent_; }
 	Environment* parent ();
 
+	// lexical addressing, for variables resolved by the parser
+	Environment* ancestor (int depth);
+	inline Value* slot (int i) { return vals_[i]; }
+	inline Value** slots () { return vals_; }
+
 
 	class iterator
 	{
 	private:
-		map_t::iterator it_;	
+		map_t::iterator it_;
+		Value** val_; // for frames
 	public:
-		iterator (decltype(it_)&& it)
-			: it_(it) {}
-		Value* operator* () { return it_->second; }
-		iterator& operator++ () { it_++; return *this; }
-		bool operator!= (const iterator& o) { return it_ != o.it_; }
+		iterator (map_t::iterator&& it)
+			: it_(it), val_(nullptr) {}
+		iterator (Value** val)
+			: val_(val) {}
+		Value* operator* () { return val_ ? *val_ : it_->second; }
+		iterator& operator++ ()
+		{ if (val_) val_++; else it_++; return *this; }
+		bool operator!= (const iterator& o)
+		{ return val_ ? val_ != o.val_ : it_ != o.it_; }
 	};
-	inline iterator begin () { return iterator(data_.begin()); }
-	inline iterator end () { return iterator(data_.end()); }
+	inline iterator begin ()
+	{ return names_ ? iterator(vals_) : iterator(data_.begin()); }
+	inline iterator end ()
+	{ return names_ ? iterator(vals_ + names_->size()) : iterator(data_.end()); }
 private:
 	map_t data_;
 	Value* parent_;
+	const std::vector<Symbol>* names_;
+	Value** vals_;
+
+	bool getParent_ (Value*& out, Symbol name);
 
 	static Context global_;
 	void populateGlobal (Context* ctx); // located in GlobalEnvironment.cpp
@@ -3,6 +3,12 @@
 #include "Error.h"
 #include "Context.h"
 #include "Environment.h"
+#include "Bytecode.h"
+#include "Operator.h"
+#include "Types.h"
+#include "Jit.h"
+#include "Aot.h"
+#include "Stats.h"
 
 namespace ml {
 
@@ -16,43 +22,218 @@ bool Expression::eval (Value*& out, Context* ctx, Error& err)
 	return false;
 }
 
+void Expression::resolve (const Scope& scope) {}
+void Expression::link (Environment* env) {}
+
+Value* Expression::constant () { return nullptr; }
+void Expression::forces (std::vector<bool>& params) {}
+void Expression::captures (std::vector<Symbol>& names) {}
+void Expression::demand (bool tail) {}
+
+Exp::ptr Expression::optimize (Context* ctx, bool demanded, int depth)
+{ return nullptr; }
+Exp::ptr Expression::inlined (Exp::Inlining& in) { return nullptr; }
+bool Expression::atomic () const { return false; }
+
+void Expression::print (std::ostream& os) const
+{
+	os << "<" << type() << ">";
+}
+
+bool Expression::infer (Types::Type*& out, Types::Infer& in, Error& err)
+{
+	// could be anything
+	out = in.var();
+	return true;
+}
+
+bool Expression::jit (Jit::Emitter& e, Jit::Kind& kind) { return false; }
+bool Expression::jitArgs (Jit::Emitter& e, LambdaFuncData*& fn) { return false; }
+bool Expression::emit (Aot::Writer& w, int out) { return w.unsupported(this); }
+
+void Expression::compile (Bytecode::Code& code)
+{
+	// fall back on the tree walker
+	code.emit(Bytecode::Op::Eval);
+	code.emit(Bytecode::word(this));
+	code.push();
+}
+
 
 
 namespace Exp {
 
 
-class NumberExpression
+bool optimizing = true;
+bool dumping = false;
+
+// calls are only inlined this many levels deep, and only if the
+// body has at most this many nodes
+static const int MaxInlineDepth = 3;
+static const int InlineBudget = 16;
+
+void optimize (ptr& e, Context* ctx, bool demanded, int depth)
+{
+	if (auto simpler = e->optimize(ctx, demanded, depth))
+		e = simpler;
+}
+
+// inlined into the tree walker, which nests on the C++ stack
+static inline bool apply_ (Value*& out, Context* ctx, Value* base,
+			Value** args, int n, bool direct, Error& err)
+{
+	bool allTrivial = true;
+
+	for (int i = 0; i < n; i++)
+		if (!Value::trivialEval(args[i]))
+			allTrivial = false;
+
+	// eager application when trivial 
+	if (allTrivial && Value::isType(base, Value::Type::NativeFunc) &&
+			n == base->native_.nargs)
+	{
+		return base->apply(out, ctx, args, err);
+	}
+
+	// sure to be forced, and not a tail call
+	if (direct)
+		return base->apply(out, ctx, args, err) &&
+			Value::eval(out, ctx, out, err);
+
+	out = ctx->apply(base, args, n);
+	return true;
+}
+
+bool apply (Value*& out, Context* ctx, Value* base, Value** args,
+			int n, bool direct, Error& err)
+{
+	return apply_(out, ctx, base, args, n, direct, err);
+}
+
+// native code for an immediate Int or Bool
+static bool jitConstant_ (Value* v, Jit::Emitter& e, Jit::Kind& kind)
+{
+	if (v == nullptr || !Value::isImmediate(v))
+		return false;
+
+	switch (Value::typeOf(v))
+	{
+	case Value::Type::Int:
+		e.constant(Value::intValue(v));
+		kind = Jit::Kind::Int;
+		return true;
+	case Value::Type::Bool:
+		e.constant(Value::boolValue(v) ? 1 : 0);
+		kind = Jit::Kind::Bool;
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+
+class ConstExpression
 	: public Expression
 {
 public:
+	ConstExpression (Value* value)
+		: value_(value) {}
+
+	virtual ~ConstExpression () { }
+	virtual std::string type () const { return "constant"; }
+
+	virtual bool eval (Value*& out, Context* ctx, Error& err)
+	{
+		out = value_;
+		return true;
+	}
+
+	virtual void compile (Bytecode::Code& code)
+	{
+		code.emit(Bytecode::Op::Const);
+		code.emit(Bytecode::word(value_));
+		code.push();
+	}
+
+	virtual Value* constant () { return value_; }
+
+	virtual ptr inlined (Inlining& in)
+	{
+		if (!in.spend())
+			return nullptr;
+		return std::make_shared<ConstExpression>(value_);
+	}
+	virtual bool atomic () const { return true; }
+
+	virtual void print (std::ostream& os) const
+	{
+		os << Value::str(value_);
+	}
+
+	virtual bool infer (Types::Type*& out, Types::Infer& in, Error& err)
+	{
+		out = in.of(value_);
+		return true;
+	}
+
+	virtual bool jit (Jit::Emitter& e, Jit::Kind& kind)
+	{
+		return jitConstant_(value_, e, kind);
+	}
+
+	virtual bool emit (Aot::Writer& w, int out)
+	{
+		std::string c;
+		if (!w.constant(c, value_))
+			return w.unsupported(this);
+		w.line() << "v" << out << " = " << c << ";";
+		return true;
+	}
+protected:
+	Value* value_;
+};
+ptr makeConstant (Value* val)
+{ return std::make_shared<ConstExpression>(val); }
+
+
+class NumberExpression
+	: public ConstExpression
+{
+public:
+	// literals are materialized once and shared by every evaluation
 	template <typename T>
 	NumberExpression (bool real, T num)
-		: real_(real)
+		: ConstExpression(nullptr)
 	{
 		if (real)
-			realNum_ = (real_t) num;
+		{
+			value_ = Value::encodeReal((real_t) num);
+			if (value_ == nullptr)
+			{
+				value_ = constantBox_(Value::Type::Real);
+				value_->real_.value = (real_t) num;
+			}
+		}
 		else
-			intNum_ = (int_t) num;
+		{
+			value_ = Value::encodeInt((int_t) num);
+			if (value_ == nullptr)
+			{
+				value_ = constantBox_(Value::Type::Int);
+				value_->int_.value = (int_t) num;
+			}
+		}
 	}
 	
 	virtual ~NumberExpression () { }
 	virtual std::string type () const { return "constant-number"; }
-
-	virtual bool eval (Value*& out, Context* ctx, Error& err)
-	{
-		if (real_)
-			out = ctx->makeReal(realNum_);
-		else
-			out = ctx->makeInt(intNum_);
-
-		return true;
-	}
 private:
-	union {
-		real_t realNum_;
-		int_t intNum_;
-	};
-	bool real_;
+	// for numbers that do not fit in an immediate. these are never
+	// freed (or collected), since results may still point at them
+	// after the expression is gone
+	static Value* constantBox_ (Value::Type t)
+	{ return new Value(t); }
 };
 ptr makeInt (int_t num)
 { return std::make_shared<NumberExpression>(false, num); }
@@ -65,8 +246,9 @@ class VarExpression
 	: public Expression
 {
 public:
-	VarExpression (const std::string& var, bool global)
-		: var_(var), global_(global), cache_(nullptr)
+	VarExpression (const Symbol& var, bool global)
+		: var_(var), global_(global), cache_(nullptr),
+		  depth_(0), slot_(-1)
 	{
 		if (global_)
 		{
@@ -79,6 +261,152 @@ public:
 	ptr makeLambda (const LambaData& data);
 	virtual std::string type () const { return "variable"; }
 
+	virtual void resolve (const Scope& scope)
+	{
+		if (global_)
+			return;
+
+		depth_ = 0;
+		slot_ = -1;
+		for (auto names : scope)
+		{
+			for (std::size_t i = 0; i < names->size(); i++)
+				if ((*names)[i] == var_)
+				{
+					slot_ = i;
+					return;
+				}
+			depth_++;
+		}
+
+		// not a local, so skip straight past the frames
+	}
+
+	virtual void link (Environment* env)
+	{
+		// definitions can't be overridden, so they are safe to keep.
+		// names that are still undefined fail when evaluated
+		if (cache_ == nullptr && slot_ < 0 && !global_)
+			if (!env->get(cache_, var_))
+				cache_ = nullptr;
+	}
+
+	virtual void compile (Bytecode::Code& code)
+	{
+		using namespace Bytecode;
+
+		if (cache_)
+		{
+			code.emit(Op::Const);
+			code.emit(word(cache_));
+		}
+		else if (slot_ >= 0 && depth_ == 0)
+		{
+			code.emit(Op::Local);
+			code.emit(slot_);
+		}
+		else if (slot_ >= 0)
+		{
+			code.emit(Op::Upvalue);
+			code.emit(depth_);
+			code.emit(slot_);
+		}
+		else if (global_)
+			Expression::compile(code);
+		else
+		{
+			code.emit(Op::Name);
+			code.emit(depth_);
+			code.emit(code.syms.size());
+			code.syms.push_back(var_);
+		}
+		code.push();
+	}
+
+	virtual Value* constant () { return cache_; }
+
+	virtual void forces (std::vector<bool>& params)
+	{
+		if (slot_ >= 0 && depth_ == 0 && slot_ < int(params.size()))
+			params[slot_] = true;
+	}
+
+	virtual void captures (std::vector<Symbol>& names)
+	{
+		// globals are looked up in the global environment
+		if (cache_ == nullptr && !global_ && !(slot_ >= 0 && depth_ == 0))
+			names.push_back(var_);
+	}
+
+	virtual ptr inlined (Inlining& in)
+	{
+		if (!in.spend())
+			return nullptr;
+
+		if (slot_ >= 0 && depth_ == 0)
+		{
+			// the argument is evaluated once per use now
+			auto& arg = in.args[slot_];
+			if (in.uses[slot_]++ > 0 && !arg->atomic())
+				return nullptr;
+			return arg;
+		}
+
+		// names looked up through the frame could be captured by
+		// the caller's parameters
+		if (cache_ == nullptr && !global_)
+			return nullptr;
+		if (cache_ == in.func)
+			return nullptr;
+		return std::make_shared<VarExpression>(*this);
+	}
+	virtual bool atomic () const { return true; }
+
+	virtual void print (std::ostream& os) const
+	{
+		os << var_.str();
+	}
+
+	virtual bool infer (Types::Type*& out, Types::Infer& in, Error& err)
+	{
+		if (slot_ >= 0 && depth_ == 0 && in.params)
+		{
+			out = (*in.params)[slot_];
+			return true;
+		}
+		if (cache_)
+			return in.use(out, cache_, err);
+
+		// fails when evaluated, if it's still undefined by then
+		out = in.var();
+		return true;
+	}
+
+	virtual bool jit (Jit::Emitter& e, Jit::Kind& kind)
+	{
+		if (slot_ >= 0 && depth_ == 0)
+		{
+			e.param(slot_);
+			kind = Jit::Kind::Int;
+			return true;
+		}
+		return jitConstant_(cache_, e, kind);
+	}
+
+	virtual bool emit (Aot::Writer& w, int out)
+	{
+		if (slot_ >= 0 && depth_ == 0)
+			w.line() << "v" << out << " = params[" << slot_ << "];";
+		else if (cache_)
+			w.line() << "v" << out << " = " << w.global(var_.str()) << ";";
+		else if (slot_ < 0)
+			w.line() << "if (!Aot::lookup(v" << out << ", ctx, "
+			         << w.quote(var_.str()) << ", err)) return false;";
+		else
+			return w.unsupported(this);
+		return true;
+	}
+
 	virtual bool eval (Value*& out, Context* ctx, Error& err)
 	{
 		if (cache_)
@@ -86,24 +414,30 @@ public:
 			out = cache_;
 			return true;
 		}
+		if (slot_ >= 0)
+		{
+			out = ctx->env()->ancestor(depth_)->slot(slot_);
+			return true;
+		}
 		auto env = global_ ?
 					Environment::global() :
-					ctx->env();
+					ctx->env()->ancestor(depth_);
 		
 		if (!env->get(out, var_))
 		{
-			err.die(ctx) << "could not find variable '" << var_ << "'";
+			err.die(ctx) << "could not find variable '" << var_.str() << "'";
 			return false;
 		}
 		else
 			return true;
 	}
 private:
-	std::string var_;
+	Symbol var_;
 	bool global_;
 	Value* cache_;
+	int depth_, slot_; // slot_ < 0 if not a local
 };
-ptr makeVariable (const std::string& var, bool g)
+ptr makeVariable (const Symbol& var, bool g)
 { return std::make_shared<VarExpression>(var, g); }
 
 
@@ -114,47 +448,595 @@ class ApplyExpression
 {
 public:
 	ApplyExpression (ptr base, const std::vector<ptr>& args)
-		: base_(base), args_(args) {}
+		: base_(base), args_(args), direct_(false), dynamic_(false),
+		  cache_ { nullptr, false } {}
 
 	virtual ~ApplyExpression () { }
 	virtual std::string type () const { return "application"; }
 
 	virtual bool eval (Value*& out, Context* ctx, Error& err)
 	{
-		Value* base, *arg;
-		std::vector<Value*> args;
-		args.reserve(args_.size());
-		bool allTrivial = true;
+		Value* base = nullptr;
+		std::vector<Value*> args(args_.size(), nullptr);
+
+		// arguments may force values (e.g. if-expressions)
+		Context::Root baseRoot(base), argsRoot(args);
 
 		if (!base_->eval(base, ctx, err))
 			return false;
 		
+		for (int i = 0, n = args_.size(); i < n; i++)
+			if (!evalArg_(args[i], i, ctx, err))
+				return false;
+
+		return apply_(out, ctx, base, args.data(), err);
+	}
+
+	virtual void resolve (const Scope& scope)
+	{
+		base_->resolve(scope);
+		for (auto& e : args_)
+			e->resolve(scope);
+	}
+	virtual void link (Environment* env)
+	{
+		base_->link(env);
+		for (auto& e : args_)
+			e->link(env);
+	}
+
+	virtual void compile (Bytecode::Code& code)
+	{
+		using namespace Bytecode;
+
+		base_->compile(code);
+		for (int i = 0, n = args_.size(); i < n; i++)
+		{
+			args_[i]->compile(code);
+			if (forced_(i))
+				code.emit(Op::Force);
+		}
+
+		// the spine works out what the callee is, so a dynamic call
+		// needs no cache here
+		code.emit(direct_ || dynamic_ ? Op::Call : Op::Apply);
+		code.emit(args_.size());
+		code.pop(args_.size());
+	}
+
+	virtual void forces (std::vector<bool>& params)
+	{
+		std::vector<bool> strict;
+		strictArgs_(strict);
+
+		base_->forces(params);
+		for (int i = 0, n = args_.size(); i < n; i++)
+			if (strict[i])
+				args_[i]->forces(params);
+	}
+
+	virtual void captures (std::vector<Symbol>& names)
+	{
+		base_->captures(names);
 		for (auto& e : args_)
-			if (!e->eval(arg, ctx, err))
+			e->captures(names);
+	}
+
+	virtual void demand (bool tail)
+	{
+		Value* f = base_->constant();
+
+		strictArgs_(strict_);
+		direct_ = !tail && f != nullptr &&
+			Value::typeOf(f) == Value::Type::LambdaFunc &&
+			Value::numArgs(f) == int(args_.size());
+		dynamic_ = !tail && f == nullptr;
+
+		base_->demand(false);
+		for (int i = 0, n = args_.size(); i < n; i++)
+			if (strict_[i])
+				args_[i]->demand(false);
+	}
+
+	virtual ptr optimize (Context* ctx, bool demanded, int depth)
+	{
+		std::vector<bool> strict;
+		strictArgs_(strict);
+
+		Exp::optimize(base_, ctx, demanded, depth);
+		for (int i = 0, n = args_.size(); i < n; i++)
+			Exp::optimize(args_[i], ctx, demanded && strict[i], depth);
+
+		Value* f = base_->constant();
+		int n = args_.size();
+
+		if (f == nullptr)
+			return nullptr;
+
+		if (Value::isType(f, Value::Type::NativeFunc) && f->native_.nargs == n)
+			return fold_(ctx, f);
+
+		// the body may call natives right away where the call would
+		// have waited, so only inline calls that are forced anyway
+		if (demanded && Value::isType(f, Value::Type::LambdaFunc) &&
+				Value::numArgs(f) == n && depth < MaxInlineDepth)
+		{
+			Inlining in { ctx, f, args_, std::vector<int>(n), InlineBudget };
+
+			if (auto body = f->lambda_->body->inlined(in))
+			{
+				Exp::optimize(body, ctx, true, depth + 1);
+				return body;
+			}
+		}
+		return nullptr;
+	}
+
+	virtual ptr inlined (Inlining& in)
+	{
+		ptr base;
+		std::vector<ptr> args;
+
+		if (!inlinedParts_(base, args, in))
+			return nullptr;
+
+		auto e = makeApplication(base, args);
+		e->span = span;
+		return e;
+	}
+
+	virtual bool infer (Types::Type*& out, Types::Infer& in, Error& err)
+	{
+		std::vector<Types::Type*> args;
+		return inferCall_(out, args, in, err);
+	}
+
+	virtual bool emit (Aot::Writer& w, int out)
+	{
+		int base = w.local();
+
+		if (!base_->emit(w, base) || !emitArgs_(w))
+			return false;
+		emitApply_(w, out, base);
+		w.close();
+		return true;
+	}
+
+	virtual bool jitArgs (Jit::Emitter& e, LambdaFuncData*& fn)
+	{
+		Value* f = base_->constant();
+		int n = args_.size();
+		Jit::Kind kind;
+
+		// the compiled code can only pass Ints, so the callee must
+		// force all of them anyway
+		if (!demanded_() || f == nullptr ||
+				!Value::isType(f, Value::Type::LambdaFunc) ||
+				Value::numArgs(f) != n || n > Jit::MaxArgs)
+			return false;
+		for (int i = 0; i < n; i++)
+			if (!strict_[i])
+				return false;
+
+		// the first argument ends up on top
+		for (int i = n; i-- > 0; )
+		{
+			if (!args_[i]->jit(e, kind) || kind != Jit::Kind::Int)
 				return false;
+			e.push();
+		}
+
+		fn = f->lambda_;
+		return true;
+	}
+
+	virtual bool jit (Jit::Emitter& e, Jit::Kind& kind)
+	{
+		LambdaFuncData* fn;
+
+		if (!jitArgs(e, fn))
+			return false;
+		e.call(fn, args_.size(), !direct_);
+		kind = Jit::Kind::Int;
+		return true;
+	}
+
+	virtual void print (std::ostream& os) const
+	{
+		os << "(";
+		base_->print(os);
+		for (auto& e : args_)
+		{
+			os << " ";
+			e->print(os);
+		}
+		os << ")";
+	}
+protected:
+	ptr base_;
+	std::vector<ptr> args_;
+
+	bool inlinedParts_ (ptr& base, std::vector<ptr>& args, Inlining& in)
+	{
+		if (!in.spend())
+			return false;
+
+		base = base_->inlined(in);
+		if (base == nullptr)
+			return false;
+		for (auto& e : args_)
+			if (auto arg = e->inlined(in))
+				args.push_back(arg);
 			else
+				return false;
+		return true;
+	}
+
+	bool inferCall_ (Types::Type*& out, std::vector<Types::Type*>& args,
+						Types::Infer& in, Error& err)
+	{
+		using namespace Types;
+		Type* t;
+
+		if (!base_->infer(t, in, err))
+			return false;
+		for (auto& e : args_)
+		{
+			Type* arg;
+			if (!e->infer(arg, in, err))
+				return false;
+			args.push_back(arg);
+		}
+
+		for (int i = 0, n = args_.size(); i < n; i++)
+		{
+			if (Types::resolve(t)->kind == Type::Kind::Var)
+				in.unify(t, in.func(in.var(), in.var()), span, err);
+			t = Types::resolve(t);
+
+			if (t->kind != Type::Kind::Func)
 			{
-				args.push_back(arg);
-				if (!arg->trivialEval())
-					allTrivial = false;
+				err.die(base_->span) << "cannot apply value of type " << str(t);
+				return false;
 			}
+			if (!in.unify(t->from, args[i], args_[i]->span, err))
+				return false;
+			t = t->to;
+		}
+
+		out = t;
+		return true;
+	}
+
+	// set by demand()
+	bool demanded_ () const { return !strict_.empty(); }
+
+	// whether the compiled argument needs Op::Force
+	bool forced_ (int i)
+	{
+		return !strict_.empty() && strict_[i] &&
+			args_[i]->constant() == nullptr;
+	}
+
+	bool evalArg_ (Value*& out, int i, Context* ctx, Error& err)
+	{
+		if (!args_[i]->eval(out, ctx, err))
+			return false;
 
-		// eager application when trivial 
-		if (allTrivial && base->isType(Value::Type::NativeFunc) &&
-				int(args.size()) == base->native_.nargs)
+		// forced by the call anyway, so don't leave a thunk
+		if (!strict_.empty() && strict_[i])
+			return Value::eval(out, ctx, out, err);
+		return true;
+	}
+
+	bool apply_ (Value*& out, Context* ctx, Value* base, Value** args,
+					Error& err)
+	{
+		bool direct = direct_;
+
+		if (dynamic_)
 		{
-			return base->apply(out, ctx, args.data(), err);
+			base = Value::deref(base);
+			direct = saturated_(base);
 		}
+		return Exp::apply_(out, ctx, base, args, args_.size(), direct, err);
+	}
+
+	// C++ for the arguments, forced like the bytecode does, and the array
+	// 'args' of them, in a block the caller has to close
+	bool emitArgs_ (Aot::Writer& w)
+	{
+		std::vector<int> args;
 
-		out = ctx->apply(base, args);
+		for (int i = 0, n = args_.size(); i < n; i++)
+		{
+			args.push_back(w.local());
+			if (!args_[i]->emit(w, args.back()))
+				return false;
+			if (forced_(i))
+				w.line() << "if (!Value::eval(v" << args.back() << ", ctx, v"
+				         << args.back() << ", err)) return false;";
+		}
+
+		w.open();
+		auto& os = w.line() << "Value* args[] = {";
+		for (std::size_t i = 0; i < args.size(); i++)
+			os << (i ? ", v" : " v") << args[i];
+		os << " };";
 		return true;
 	}
+
+	// C++ for apply_
+	void emitApply_ (Aot::Writer& w, int out, int base)
+	{
+		Value* f = base_->constant();
+		auto name = f != nullptr && direct_ &&
+					Value::isType(f, Value::Type::LambdaFunc) ?
+						w.function(f->lambda_) : nullptr;
+
+		// straight into the compiled body, without making a frame
+		if (name)
+			w.line() << "if (!" << *name << "(v" << out << ", ctx, args, err) ||"
+			         << " !Value::eval(v" << out << ", ctx, v" << out
+			         << ", err)) return false;";
+		else
+			w.line() << "if (!Exp::apply(v" << out << ", ctx, v" << base
+			         << ", args, " << args_.size() << ", "
+			         << (direct_ ? "true" : "false") << ", err)) return false;";
+	}
+
 private:
-	ptr base_;
-	std::vector<ptr> args_;
+	// arguments to force before the call, and whether to call
+	// right away rather than make a thunk. set by demand()
+	std::vector<bool> strict_;
+	bool direct_;
+	// demanded and not a tail call, but the callee is only known at
+	// runtime: call right away if it turns out to take exactly the
+	// arguments given
+	bool dynamic_;
+
+	// the last callee at a dynamic site, and whether it took exactly
+	// the arguments. only functions and builtins are kept, which are
+	// never collected, so the pointer can't come back as another Value
+	struct
+	{
+		Value* callee;
+		bool saturated;
+	} cache_;
+
+	bool saturated_ (Value* f)
+	{
+		if (f == cache_.callee)
+		{
+			Stats::callHits++;
+			return cache_.saturated;
+		}
+		Stats::callMisses++;
+
+		switch (Value::typeOf(f))
+		{
+		case Value::Type::LambdaFunc:
+		case Value::Type::NativeFunc:
+			cache_.callee = f;
+			cache_.saturated = Value::numArgs(f) == int(args_.size());
+			return cache_.saturated;
+		default:
+			return false;
+		}
+	}
+
+	// call a native function on constant arguments now, as long as
+	// the result is an immediate too. errors are left for runtime
+	ptr fold_ (Context* ctx, Value* f)
+	{
+		std::vector<Value*> args;
+		Value* out;
+		Error err;
+
+		for (auto& e : args_)
+		{
+			Value* v = e->constant();
+			if (v == nullptr || !Value::isImmediate(v))
+				return nullptr;
+			args.push_back(v);
+		}
+
+		if (!f->apply(out, ctx, args.data(), err) || !Value::isImmediate(out))
+			return nullptr;
+		return makeConstant(out);
+	}
+
+	// the arguments that are sure to be forced when the call is
+	void strictArgs_ (std::vector<bool>& out)
+	{
+		Value* f = base_->constant();
+		int n = args_.size();
+
+		out.assign(n, false);
+		if (f == nullptr)
+			return;
+
+		switch (Value::typeOf(f))
+		{
+		case Value::Type::NativeFunc:
+			if (f->native_.nargs == n)
+				out.assign(n, true);
+			break;
+		case Value::Type::LambdaFunc:
+			if (int(f->lambda_->strict.size()) == n)
+				out = f->lambda_->strict;
+			break;
+		default:
+			break;
+		}
+	}
+};
+
+
+class OperatorExpression
+	: public ApplyExpression
+{
+public:
+	OperatorExpression (Operator::Kind op, ptr base, const std::vector<ptr>& args)
+		: ApplyExpression(base, args), op_(op), func_(base->constant()),
+		  ints_(false) {}
+
+	virtual ~OperatorExpression () { }
+	virtual std::string type () const { return "operator"; }
+
+	virtual bool eval (Value*& out, Context* ctx, Error& err)
+	{
+		Value* args[2] = { nullptr, nullptr };
+		Context::Root root(args, 2);
+
+		if (!evalArg_(args[0], 0, ctx, err) ||
+				!evalArg_(args[1], 1, ctx, err))
+			return false;
+
+		Value* a = Value::deref(args[0]), *b = Value::deref(args[1]);
+
+		// the types say they can only be Ints, once forced
+		if (ints_)
+		{
+			if (Value::isImmediate(a) && Value::isImmediate(b) &&
+					Operator::evalInt(out, ctx, op_,
+						Value::intValue(a), Value::intValue(b)))
+				return true;
+		}
+		else if (Operator::eval(out, ctx, op_, a, b))
+			return true;
+
+		return apply_(out, ctx, func_, args, err);
+	}
+
+	virtual void compile (Bytecode::Code& code)
+	{
+		using namespace Bytecode;
+
+		// laid out like an application, for when it falls back on one
+		code.emit(Op::Const);
+		code.emit(word(func_));
+		code.push();
+		for (int i = 0; i < 2; i++)
+		{
+			args_[i]->compile(code);
+			if (forced_(i))
+				code.emit(Op::Force);
+		}
+
+		code.emit(ints_ ? Op::ArithInt : Op::Arith);
+		code.emit(op_);
+		code.pop(2);
+	}
+
+	virtual ptr inlined (Inlining& in)
+	{
+		ptr base;
+		std::vector<ptr> args;
+
+		if (!inlinedParts_(base, args, in))
+			return nullptr;
+
+		// the arguments have the same types as the parameters did
+		auto e = std::make_shared<OperatorExpression>(op_, base, args);
+		e->span = span;
+		e->ints_ = ints_;
+		return e;
+	}
+
+	virtual bool infer (Types::Type*& out, Types::Infer& in, Error& err)
+	{
+		std::vector<Types::Type*> args;
+
+		if (!inferCall_(out, args, in, err))
+			return false;
+
+		in.finish.push_back([this, args] {
+			ints_ = Types::isInt(args[0]) && Types::isInt(args[1]);
+		});
+		return true;
+	}
+
+	virtual bool emit (Aot::Writer& w, int out)
+	{
+		static const char* names[] = {
+			"None", "Add", "Sub", "Mul", "Div",
+			"Gt", "Lt", "Ge", "Le", "Eq", "Ne"
+		};
+		std::string op = std::string("Operator::") + names[op_];
+		int base = w.local();
+
+		if (!base_->emit(w, base) || !emitArgs_(w))
+			return false;
+		w.line() << "Value* a = Value::deref(args[0]), *b = Value::deref(args[1]);";
+		if (ints_)
+			w.line() << "if (!Value::isImmediate(a) || !Value::isImmediate(b) ||"
+			         << " !Operator::evalInt(v" << out << ", ctx, " << op
+			         << ", Value::intValue(a), Value::intValue(b)))";
+		else
+			w.line() << "if (!Operator::eval(v" << out << ", ctx, " << op
+			         << ", a, b))";
+		w.open();
+		emitApply_(w, out, base);
+		w.close();
+		w.close();
+		return true;
+	}
+
+	virtual bool jit (Jit::Emitter& e, Jit::Kind& kind)
+	{
+		// division makes a Real
+		if (!ints_ || op_ == Operator::Div || !demanded_())
+			return false;
+
+		// 'a <op> f(x)': start f(x) while working out 'a', if that's
+		// more than a lookup
+		LambdaFuncData* fn;
+		if (Jit::workers > 0 && !args_[0]->atomic() &&
+				args_[1]->jitArgs(e, fn))
+		{
+			e.fork(fn, fn->argNames.size());
+			if (!args_[0]->jit(e, kind) || kind != Jit::Kind::Int)
+				return false;
+			e.join(fn, fn->argNames.size(), op_);
+		}
+		else
+		{
+			if (!args_[0]->jit(e, kind) || kind != Jit::Kind::Int)
+				return false;
+			e.push();
+			if (!args_[1]->jit(e, kind) || kind != Jit::Kind::Int)
+				return false;
+			e.arith(op_);
+		}
+
+		switch (op_)
+		{
+		case Operator::Add: case Operator::Sub: case Operator::Mul:
+			kind = Jit::Kind::Int;
+			break;
+		default:
+			kind = Jit::Kind::Bool;
+			break;
+		}
+		return true;
+	}
+private:
+	Operator::Kind op_;
+	Value* func_;
+	bool ints_; // both sides are sure to be Ints
 };
+
 ptr makeApplication (ptr base, const std::vector<ptr>& args) 
-{ return std::make_shared<ApplyExpression>(base, args); }
+{
+	auto op = args.size() == 2 ?
+				Operator::of(base->constant()) :
+				Operator::None;
+
+	if (op != Operator::None)
+		return std::make_shared<OperatorExpression>(op, base, args);
+	return std::make_shared<ApplyExpression>(base, args);
+}
 
 
 class LambdaExpression
@@ -162,7 +1044,10 @@ class LambdaExpression
 {
 public:
 	LambdaExpression (const LambaData& data)
-		: lambda_(data) {}
+		: lambda_(data), code_(std::make_shared<Bytecode::Code>())
+	{
+		lambda_.body->resolve({ &lambda_.args });
+	}
 	
 	virtual ~LambdaExpression () { }
 	virtual std::string type () const { return "lambda"; }
@@ -173,14 +1058,48 @@ public:
 			{
 				lambda_.args,
 				lambda_.body,
-				nullptr
+				nullptr,
+				code_
 			};
 
 		out = ctx->makeFunction(data);
 		return true;
 	}
+
+	virtual void resolve (const Scope& scope)
+	{
+		Scope inner { &lambda_.args };
+		inner.insert(inner.end(), scope.begin(), scope.end());
+		lambda_.body->resolve(inner);
+	}
+	virtual void link (Environment* env)
+	{
+		lambda_.body->link(env);
+	}
+
+	virtual void captures (std::vector<Symbol>& names)
+	{
+		lambda_.body->captures(names);
+	}
+
+	virtual ptr optimize (Context* ctx, bool demanded, int depth)
+	{
+		Exp::optimize(lambda_.body, ctx, true, depth);
+		return nullptr;
+	}
+
+	virtual void print (std::ostream& os) const
+	{
+		os << "(fn";
+		for (auto& arg : lambda_.args)
+			os << " " << arg.str();
+		os << " = ";
+		lambda_.body->print(os);
+		os << ")";
+	}
 private:
 	LambaData lambda_;
+	std::shared_ptr<Bytecode::Code> code_;
 };
 
 ptr makeLambda (const LambaData& data)
@@ -203,6 +1122,36 @@ public:
 		out = (ctx->*gen_)();
 		return true;
 	}
+
+	virtual ptr optimize (Context* ctx, bool demanded, int depth)
+	{
+		Value* v = (ctx->*gen_)();
+		if (!Value::isImmediate(v))
+			return nullptr;
+		return makeConstant(v);
+	}
+	virtual ptr inlined (Inlining& in)
+	{
+		if (!in.spend())
+			return nullptr;
+		return std::make_shared<GenExpression>(*this);
+	}
+
+	virtual bool infer (Types::Type*& out, Types::Infer& in, Error& err)
+	{
+		out = in.of((in.ctx->*gen_)());
+		return true;
+	}
+
+	virtual bool emit (Aot::Writer& w, int out)
+	{
+		std::string c;
+		if (!w.constant(c, (w.ctx->*gen_)()))
+			return w.unsupported(this);
+		w.line() << "v" << out << " = " << c << ";";
+		return true;
+	}
+	virtual bool atomic () const { return true; }
 private:
 	std::string type_;
 	Generator gen_;
@@ -229,13 +1178,169 @@ public:
 
 		if (!cond_->eval(cond, ctx, err))
 			return false;
-		if (!cond->eval(cond, ctx, err))
+		if (!Value::eval(cond, ctx, cond, err))
 			return false;
-		if (cond->condition())
+		if (Value::condition(cond))
 			return then_->eval(out, ctx, err);
 		else
 			return else_->eval(out, ctx, err);	
 	}
+
+	virtual void resolve (const Scope& scope)
+	{
+		cond_->resolve(scope);
+		then_->resolve(scope);
+		else_->resolve(scope);
+	}
+	virtual void link (Environment* env)
+	{
+		cond_->link(env);
+		then_->link(env);
+		else_->link(env);
+	}
+
+	virtual void compile (Bytecode::Code& code)
+	{
+		using namespace Bytecode;
+
+		cond_->compile(code);
+		code.emit(Op::JumpIfNot);
+		int jumpElse = code.here();
+		code.emit(0);
+		code.pop();
+
+		then_->compile(code);
+		code.emit(Op::Jump);
+		int jumpEnd = code.here();
+		code.emit(0);
+		code.pop();
+
+		code.ops[jumpElse] = code.here();
+		else_->compile(code);
+		code.ops[jumpEnd] = code.here();
+	}
+
+	virtual void forces (std::vector<bool>& params)
+	{
+		// only what both branches force
+		std::vector<bool> a(params.size()), b(params.size());
+		then_->forces(a);
+		else_->forces(b);
+
+		cond_->forces(params);
+		for (int i = 0, n = params.size(); i < n; i++)
+			if (a[i] && b[i])
+				params[i] = true;
+	}
+
+	virtual void captures (std::vector<Symbol>& names)
+	{
+		cond_->captures(names);
+		then_->captures(names);
+		else_->captures(names);
+	}
+
+	virtual void demand (bool tail)
+	{
+		cond_->demand(false);
+		then_->demand(tail);
+		else_->demand(tail);
+	}
+
+	virtual ptr optimize (Context* ctx, bool demanded, int depth)
+	{
+		Exp::optimize(cond_, ctx, true, depth);
+		Exp::optimize(then_, ctx, demanded, depth);
+		Exp::optimize(else_, ctx, demanded, depth);
+
+		Value* c = cond_->constant();
+		if (c != nullptr && Value::isType(c, Value::Type::Bool))
+			return Value::boolValue(c) ? then_ : else_;
+		return nullptr;
+	}
+
+	virtual ptr inlined (Inlining& in)
+	{
+		if (!in.spend())
+			return nullptr;
+
+		// an if forces its condition as soon as it is evaluated, which
+		// the call would not have. so only inline it if it goes away
+		auto cond = cond_->inlined(in);
+		if (cond == nullptr)
+			return nullptr;
+		Exp::optimize(cond, in.ctx, false, MaxInlineDepth);
+
+		Value* c = cond->constant();
+		if (c == nullptr || !Value::isType(c, Value::Type::Bool))
+			return nullptr;
+		return (Value::boolValue(c) ? then_ : else_)->inlined(in);
+	}
+
+	virtual bool infer (Types::Type*& out, Types::Infer& in, Error& err)
+	{
+		Types::Type* cond, *otherwise;
+
+		// any value will do as a condition
+		return cond_->infer(cond, in, err) &&
+			then_->infer(out, in, err) &&
+			else_->infer(otherwise, in, err) &&
+			in.unify(out, otherwise, else_->span, err);
+	}
+
+	virtual bool emit (Aot::Writer& w, int out)
+	{
+		int cond = w.local();
+
+		if (!cond_->emit(w, cond))
+			return false;
+		w.line() << "if (!Value::eval(v" << cond << ", ctx, v" << cond
+		         << ", err)) return false;";
+
+		w.line() << "if (Value::condition(v" << cond << "))";
+		w.open();
+		if (!then_->emit(w, out))
+			return false;
+		w.close();
+		w.line() << "else";
+		w.open();
+		if (!else_->emit(w, out))
+			return false;
+		w.close();
+		return true;
+	}
+
+	virtual bool jit (Jit::Emitter& e, Jit::Kind& kind)
+	{
+		Jit::Kind otherwise;
+
+		// Ints are conditions as well, like Value::condition
+		if (!cond_->jit(e, kind))
+			return false;
+		int jumpElse = e.jumpIfZero();
+
+		if (!then_->jit(e, kind))
+			return false;
+		int jumpEnd = e.jump();
+
+		e.bind(jumpElse);
+		if (!else_->jit(e, otherwise))
+			return false;
+		e.bind(jumpEnd);
+
+		return kind == otherwise;
+	}
+
+	virtual void print (std::ostream& os) const
+	{
+		os << "(if ";
+		cond_->print(os);
+		os << " ";
+		then_->print(os);
+		os << " ";
+		else_->print(os);
+		os << ")";
+	}
 private:
 	ptr cond_, then_, else_;
 };
@@ -243,5 +1348,27 @@ ptr makeIf (ptr a, ptr b, ptr c)
 { return std::make_shared<IfExpression>(a, b, c); }
 
 
+
+class CompiledExpression
+	: public Expression
+{
+public:
+	CompiledExpression (Aot::Body body)
+		: body_(body) {}
+
+	virtual ~CompiledExpression () { }
+	virtual std::string type () const { return "compiled"; }
+
+	virtual bool eval (Value*& out, Context* ctx, Error& err)
+	{
+		return body_(out, ctx, ctx->env()->slots(), err);
+	}
+private:
+	Aot::Body body_;
+};
+ptr makeCompiled (Aot::Body body)
+{ return std::make_shared<CompiledExpression>(body); }
+
+
 };
 };
@@ -8,12 +8,71 @@
 
 namespace ml {
 class Context;
+class Environment;
+namespace Bytecode { struct Code; }
+namespace Exp { struct Inlining; }
+namespace Types { struct Type; class Infer; }
+namespace Jit { class Emitter; enum class Kind; }
+namespace Aot { class Writer; typedef bool (*Body) (Value*&, Context*, Value**, Error&); }
 class Expression
 {
 public:
+	// where it starts in the source, if it came from there
+	Span span;
+
+	// parameter names of the enclosing lambdas, innermost first
+	using Scope = std::vector<const std::vector<Symbol>*>;
+
 	virtual ~Expression () = 0;
 	virtual std::string type () const = 0;
 	virtual bool eval (Value*& out, Context* ctx, Error& err);
+
+	// bind variables to slots in the frames of the enclosing lambdas
+	virtual void resolve (const Scope& scope);
+	// bind the remaining variables to their definitions in 'env'
+	virtual void link (Environment* env);
+	// append code that pushes the value of the expression
+	virtual void compile (Bytecode::Code& code);
+
+	// the value the expression always evaluates to, if known
+	virtual Value* constant ();
+	// set the parameters of the enclosing lambda (by slot) that
+	// are sure to be forced when this expression is
+	virtual void forces (std::vector<bool>& params);
+	// add the variables it looks up through the environment of the
+	// enclosing lambda, which a closure over it has to keep
+	virtual void captures (std::vector<Symbol>& names);
+	// told that the value of this expression is sure to be forced;
+	// 'tail' if it is also the value of the enclosing lambda
+	virtual void demand (bool tail);
+
+	// a simpler expression with the same value, or nullptr if there
+	// is nothing to simplify. 'demanded' as for demand(), and 'depth'
+	// counts the calls inlined around it
+	virtual std::shared_ptr<Expression> optimize (Context* ctx,
+								bool demanded, int depth);
+	// a copy with the parameters replaced, for inlining the body of
+	// a function into a call to it. nullptr if it can't be inlined
+	virtual std::shared_ptr<Expression> inlined (Exp::Inlining& in);
+	// as cheap to evaluate as to keep the value of, so copying it
+	// loses no work
+	virtual bool atomic () const;
+
+	virtual void print (std::ostream& os) const;
+
+	// the type of the expression, for Types::Infer
+	virtual bool infer (Types::Type*& out, Types::Infer& in, Error& err);
+
+	// append native code that computes the value, which must be
+	// demanded. false if it can't (see Jit.h)
+	virtual bool jit (Jit::Emitter& e, Jit::Kind& kind);
+	// for a call compiled code can make: save the arguments, as for
+	// Jit::Emitter::call(), and set 'fn' to the callee. false if it
+	// isn't one, or can't be compiled
+	virtual bool jitArgs (Jit::Emitter& e, LambdaFuncData*& fn);
+	// append C++ statements that set the local 'out' to the value
+	// (see Aot.h)
+	virtual bool emit (Aot::Writer& w, int out);
 };
 
 
@@ -26,7 +85,7 @@ namespace Exp {
 		inline LambaData ()
 			: body(nullptr) {}
 		
-		std::vector<std::string> args;
+		std::vector<Symbol> args;
 		ptr body;
 	};
 	typedef Value* (Context::*Generator) ();
@@ -34,12 +93,42 @@ namespace Exp {
 
 	ptr makeInt (int_t num);
 	ptr makeReal (real_t real);	
-	ptr makeVariable (const std::string& var, bool global = false);
+	ptr makeVariable (const Symbol& var, bool global = false);
 	ptr makeApplication (ptr base, const std::vector<ptr>& args);
 	ptr makeLambda (const LambaData& data);
 	ptr makeGenerator (const std::string& name, Generator gen);
 
 	ptr makeIf (ptr cond, ptr then, ptr otherwise);
+	// a body compiled ahead of time, given the arguments in place
+	ptr makeCompiled (Aot::Body body);
+	// only for immediates, or Values that are never collected
+	ptr makeConstant (Value* val);
+
+
+	// simplify function bodies once they are linked
+	extern bool optimizing;
+	// print function bodies before and after simplifying them
+	extern bool dumping;
+
+	// replace 'e' with a simpler expression, if there is one
+	void optimize (ptr& e, Context* ctx, bool demanded, int depth = 0);
+
+	// apply 'base' to evaluated arguments, as an application does:
+	// right away for a native function if nothing needs forcing,
+	// or if 'direct' (sure to be forced, and not a tail call)
+	bool apply (Value*& out, Context* ctx, Value* base, Value** args,
+				int nargs, bool direct, Error& err);
+
+	struct Inlining
+	{
+		Context* ctx;
+		Value* func;                 // mustn't refer to itself
+		const std::vector<ptr>& args;// in place of the parameters
+		std::vector<int> uses;       // of each parameter so far
+		int budget;                  // nodes left to copy
+
+		inline bool spend () { return budget-- > 0; }
+	};
 };
 
 
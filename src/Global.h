@@ -1,9 +1,18 @@
 #pragma once
 
 
-#define ML_USE_CUSTOM_ALLOCATOR
 #define ML_DEBUG_ENABLED
 
+// dispatch bytecode through a table of labels
+#if defined(__GNUC__) || defined(__clang__)
+# define ML_COMPUTED_GOTO
+#endif
+
+// compile hot functions to native code
+#if defined(__x86_64__) && defined(__linux__)
+# define ML_JIT
+#endif
+
 
 
 
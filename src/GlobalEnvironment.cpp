@@ -3,6 +3,7 @@
 #include "Value.h"
 #include "Context.h"
 #include "Error.h"
+#include "Operator.h"
 #include <sstream>
 #include <fstream>
 #include <iomanip>
@@ -20,65 +21,65 @@ using type = Value::Type;
 
 static bool proc_add (Value*& out, Context* ctx, Value** args, Error& err)
 {
-	if (args[0]->isType(Value::Type::Int) &&
-			args[1]->isType(Value::Type::Int))
-		out = ctx->makeInt(args[0]->int_.value +
-							args[1]->int_.value);
+	if (Value::isType(args[0], Value::Type::Int) &&
+			Value::isType(args[1], Value::Type::Int))
+		out = ctx->makeInt(Value::intValue(args[0]) +
+							Value::intValue(args[1]));
 	else
-		out = ctx->makeReal(args[0]->numberValue() +
-							args[1]->numberValue());
+		out = ctx->makeReal(Value::numberValue(args[0]) +
+							Value::numberValue(args[1]));
 	return true;
 }
 static bool proc_sub (Value*& out, Context* ctx, Value** args, Error& err)
 {
-	if (args[0]->isType(Value::Type::Int) &&
-			args[1]->isType(Value::Type::Int))
-		out = ctx->makeInt(args[0]->int_.value -
-							args[1]->int_.value);
+	if (Value::isType(args[0], Value::Type::Int) &&
+			Value::isType(args[1], Value::Type::Int))
+		out = ctx->makeInt(Value::intValue(args[0]) -
+							Value::intValue(args[1]));
 	else
-		out = ctx->makeReal(args[0]->numberValue() -
-							args[1]->numberValue());
+		out = ctx->makeReal(Value::numberValue(args[0]) -
+							Value::numberValue(args[1]));
 	return true;
 }
 static bool proc_mul (Value*& out, Context* ctx, Value** args, Error& err)
 {
-	if (args[0]->isType(Value::Type::Int) &&
-			args[1]->isType(Value::Type::Int))
-		out = ctx->makeInt(args[0]->int_.value *
-							args[1]->int_.value);
+	if (Value::isType(args[0], Value::Type::Int) &&
+			Value::isType(args[1], Value::Type::Int))
+		out = ctx->makeInt(Value::intValue(args[0]) *
+							Value::intValue(args[1]));
 	else
-		out = ctx->makeReal(args[0]->numberValue() *
-							args[1]->numberValue());
+		out = ctx->makeReal(Value::numberValue(args[0]) *
+							Value::numberValue(args[1]));
 	return true;
 }
 static bool proc_div (Value*& out, Context* ctx, Value** args, Error& err)
 {
-	if (args[1]->numberValue() == 0)
+	if (Value::numberValue(args[1]) == 0)
 	{
 		err.die(ctx) << "unwilling to divide by zero";
 		return false;
 	}
-	out = ctx->makeReal(args[0]->numberValue() /
-						args[1]->numberValue());
+	out = ctx->makeReal(Value::numberValue(args[0]) /
+						Value::numberValue(args[1]));
 	return true;
 }
 static int compare (Value* a, Value* b)
 {
-	if (a->isType(type::Number) && b->isType(type::Number))
+	if (Value::isType(a, type::Number) && Value::isType(b, type::Number))
 	{
-		auto an = a->numberValue();
-		auto bn = b->numberValue();
+		auto an = Value::numberValue(a);
+		auto bn = Value::numberValue(b);
 
 		if (an == bn) return 0;
 		if (an > bn) return 1;
 		return -1;
 	}
-	if (a->type != b->type)
+	if (Value::typeOf(a) != Value::typeOf(b))
 		return 1;
-	switch (a->type)
+	switch (Value::typeOf(a))
 	{
 	case type::Bool:
-		return a->bool_ == b->bool_ ? 0 : 1;
+		return Value::boolValue(a) == Value::boolValue(b) ? 0 : 1;
 
 	case type::Void:
 		return 0;
@@ -161,5 +162,24 @@ void Environment::populateGlobal (Context* ctx)
 	addProc(ctx, "!=", proc_neq, { type::Any, type::Any });
 }
 
+Operator::Kind Operator::of (Value* func)
+{
+	if (func == nullptr || !Value::isType(func, type::NativeFunc))
+		return None;
+
+	auto ha = func->native_.handler;
+	if (ha == proc_add) return Add;
+	if (ha == proc_sub) return Sub;
+	if (ha == proc_mul) return Mul;
+	if (ha == proc_div) return Div;
+	if (ha == proc_grt) return Gt;
+	if (ha == proc_les) return Lt;
+	if (ha == proc_gre) return Ge;
+	if (ha == proc_lse) return Le;
+	if (ha == proc_eql) return Eq;
+	if (ha == proc_neq) return Ne;
+	return None;
+}
+
 
 };
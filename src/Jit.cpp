@@ -0,0 +1,692 @@
+#include "Global.h"
+#include "Jit.h"
+#include "Expression.h"
+#include "Stats.h"
+#include <cstring>
+#include <unordered_set>
+#ifdef ML_JIT
+# include <sys/mman.h>
+# include <unistd.h>
+# include <atomic>
+# include <chrono>
+# include <condition_variable>
+# include <deque>
+# include <mutex>
+# include <new>
+# include <thread>
+#endif
+
+namespace ml {
+namespace Jit {
+
+
+#ifdef ML_JIT
+bool enabled = true;
+#else
+bool enabled = false;
+#endif
+
+int workers = 0;
+
+/*
+ * Register use:
+ *
+ *   rax    the accumulator, an untagged Int (or 0/1 for a Bool)
+ *   rcx    scratch
+ *   rbx    the arguments, as Value*s
+ *   rbp    the frame, for dropping whatever was saved on bailout
+ *   r12    the stack limit, passed on to every call
+ *   r13    the stack pointer, around calls into the runtime
+ *
+ * Saved values and the arguments to calls go on the C++ stack. Calls
+ * between compiled functions don't keep to the C calling convention
+ * beyond taking 'args' in rdi and 'limit' in rsi, returning in rax and
+ * keeping rbx, rbp, r12 and r13; calls into the runtime (for tasks)
+ * align the stack first.
+ */
+
+Emitter::Emitter (LambdaFuncData* fn)
+	: self_(fn), saved_(0)
+{
+	bytes_({ 0x55 });             // push rbp
+	bytes_({ 0x48, 0x89, 0xe5 }); // mov rbp, rsp
+	bytes_({ 0x53 });             // push rbx
+	bytes_({ 0x41, 0x54 });       // push r12
+	bytes_({ 0x41, 0x55 });       // push r13
+	bytes_({ 0x48, 0x89, 0xfb }); // mov rbx, rdi
+	bytes_({ 0x49, 0x89, 0xf4 }); // mov r12, rsi
+
+	bytes_({ 0x4c, 0x39, 0xe4 }); // cmp rsp, r12
+	bailIf_(0x82);                // jb
+
+	body_ = code_.size();
+}
+
+void Emitter::byte_ (unsigned b) { code_.push_back((unsigned char) b); }
+void Emitter::bytes_ (std::initializer_list<unsigned> bs)
+{
+	for (auto b : bs)
+		byte_(b);
+}
+void Emitter::word_ (std::int32_t w)
+{
+	for (int i = 0; i < 4; i++)
+		byte_((std::uint32_t(w) >> (8 * i)) & 0xff);
+}
+void Emitter::quad_ (std::int64_t q)
+{
+	for (int i = 0; i < 8; i++)
+		byte_((std::uint64_t(q) >> (8 * i)) & 0xff);
+}
+
+// jump to the bailout on condition code 'cc'
+void Emitter::bailIf_ (unsigned cc)
+{
+	bytes_({ 0x0f, cc });
+	bails_.push_back(code_.size());
+	word_(0);
+}
+
+// Int to Value*, or bail if it doesn't fit in an immediate
+void Emitter::retag_ ()
+{
+	bytes_({ 0x48, 0x01, 0xc0 });       // add rax, rax
+	bailIf_(0x80);                      // jo
+	bytes_({ 0x48, 0x83, 0xc8, 0x01 }); // or rax, 1
+}
+
+// Value* to Int, or bail if it isn't an immediate Int
+void Emitter::untag_ ()
+{
+	bytes_({ 0xa8, 0x01 });             // test al, 1
+	bailIf_(0x84);                      // jz
+	bytes_({ 0x48, 0xd1, 0xf8 });       // sar rax, 1
+}
+
+void Emitter::leave_ ()
+{
+	bytes_({ 0x48, 0x8d, 0x65, 0xe8 }); // lea rsp, [rbp - 24]
+	bytes_({ 0x41, 0x5d, 0x41, 0x5c }); // pop r13; pop r12
+	bytes_({ 0x5b, 0x5d, 0xc3 });       // pop rbx; pop rbp; ret
+}
+
+// the saved arguments become Value*s, in calling order
+void Emitter::retagArgs_ (int nargs)
+{
+	for (int i = 0; i < nargs; i++)
+	{
+		bytes_({ 0x48, 0x8b, 0x84, 0x24 }); // mov rax, [rsp + 8 * i]
+		word_(8 * i);
+		retag_();
+		bytes_({ 0x48, 0x89, 0x84, 0x24 }); // mov [rsp + 8 * i], rax
+		word_(8 * i);
+	}
+}
+
+// call 'fn' with the arguments at rsp + 'offset'
+void Emitter::enter_ (LambdaFuncData* fn, int offset)
+{
+	bytes_({ 0x48, 0x8d, 0xbc, 0x24 }); // lea rdi, [rsp + offset]
+	word_(offset);
+	bytes_({ 0x4c, 0x89, 0xe6 });       // mov rsi, r12
+	if (fn == self_)
+	{
+		std::int32_t rel = 0 - (int(code_.size()) + 5);
+		byte_(0xe8);                    // call self
+		word_(rel);
+	}
+	else
+	{
+		// through the pointer, which may change if 'fn' gives up
+		bytes_({ 0x48, 0xb8 });         // mov rax, &fn->jit
+		quad_(std::int64_t(&fn->jit));
+		bytes_({ 0xff, 0x10 });         // call [rax]
+		callees.push_back(fn);
+	}
+}
+
+// call C++ function 'f', with its arguments already in place
+void Emitter::runtime_ (const void* f)
+{
+	bytes_({ 0x49, 0x89, 0xe5 });       // mov r13, rsp
+	bytes_({ 0x48, 0x83, 0xe4, 0xf0 }); // and rsp, -16
+	bytes_({ 0x48, 0xb8 });             // mov rax, f
+	quad_(std::int64_t(f));
+	bytes_({ 0xff, 0xd0 });             // call rax
+	bytes_({ 0x4c, 0x89, 0xec });       // mov rsp, r13
+}
+
+
+void Emitter::constant (int_t n)
+{
+	bytes_({ 0x48, 0xb8 });             // mov rax, n
+	quad_(n);
+}
+
+void Emitter::param (int slot)
+{
+	bytes_({ 0x48, 0x8b, 0x83 });       // mov rax, [rbx + 8 * slot]
+	word_(8 * slot);
+	untag_();
+}
+
+void Emitter::push ()
+{
+	byte_(0x50);                        // push rax
+	saved_++;
+}
+
+void Emitter::arith (Operator::Kind op)
+{
+	byte_(0x59);                        // pop rcx
+	saved_--;
+	op_(op);
+}
+
+// accumulator = rcx <op> accumulator
+void Emitter::op_ (Operator::Kind op)
+{
+	switch (op)
+	{
+	case Operator::Add:
+		bytes_({ 0x48, 0x01, 0xc8 });   // add rax, rcx
+		bailIf_(0x80);
+		return;
+	case Operator::Sub:
+		bytes_({ 0x48, 0x29, 0xc1 });   // sub rcx, rax
+		bailIf_(0x80);
+		bytes_({ 0x48, 0x89, 0xc8 });   // mov rax, rcx
+		return;
+	case Operator::Mul:
+		bytes_({ 0x48, 0x0f, 0xaf, 0xc1 }); // imul rax, rcx
+		bailIf_(0x80);
+		return;
+	default:
+		break;
+	}
+
+	// compared as reals, like Operator::compare_
+	unsigned cc;
+	switch (op)
+	{
+	case Operator::Gt: cc = 0x97; break; // seta
+	case Operator::Lt: cc = 0x92; break; // setb
+	case Operator::Ge: cc = 0x93; break; // setae
+	case Operator::Le: cc = 0x96; break; // setbe
+	case Operator::Eq: cc = 0x94; break; // sete
+	default: cc = 0x95; break;           // setne
+	}
+	bytes_({ 0xf2, 0x48, 0x0f, 0x2a, 0xc1 }); // cvtsi2sd xmm0, rcx
+	bytes_({ 0xf2, 0x48, 0x0f, 0x2a, 0xc8 }); // cvtsi2sd xmm1, rax
+	bytes_({ 0x66, 0x0f, 0x2e, 0xc1 });       // ucomisd xmm0, xmm1
+	bytes_({ 0x0f, cc, 0xc0 });               // setcc al
+	bytes_({ 0x0f, 0xb6, 0xc0 });             // movzx eax, al
+}
+
+int Emitter::jumpIfZero ()
+{
+	bytes_({ 0x48, 0x85, 0xc0 });       // test rax, rax
+	bytes_({ 0x0f, 0x84 });             // jz
+	int label = code_.size();
+	word_(0);
+	return label;
+}
+
+int Emitter::jump ()
+{
+	byte_(0xe9);                        // jmp
+	int label = code_.size();
+	word_(0);
+	return label;
+}
+
+void Emitter::bind (int label)
+{
+	std::int32_t rel = code_.size() - (label + 4);
+	std::memcpy(&code_[label], &rel, 4);
+}
+
+void Emitter::call (LambdaFuncData* fn, int nargs, bool tail)
+{
+	retagArgs_(nargs);
+
+	if (fn == self_ && tail && saved_ == nargs)
+	{
+		// a loop: replace the arguments and start over
+		for (int i = 0; i < nargs; i++)
+		{
+			bytes_({ 0x48, 0x8b, 0x84, 0x24 }); // mov rax, [rsp + 8 * i]
+			word_(8 * i);
+			bytes_({ 0x48, 0x89, 0x83 });       // mov [rbx + 8 * i], rax
+			word_(8 * i);
+		}
+		bytes_({ 0x48, 0x8d, 0x65, 0xe8 });     // lea rsp, [rbp - 24]
+		std::int32_t rel = body_ - (int(code_.size()) + 5);
+		byte_(0xe9);                            // jmp body
+		word_(rel);
+		saved_ -= nargs;
+		return;
+	}
+
+	enter_(fn, 0);
+	bytes_({ 0x48, 0x81, 0xc4 });       // add rsp, 8 * nargs
+	word_(8 * nargs);
+	saved_ -= nargs;
+
+	bytes_({ 0x48, 0x85, 0xc0 });       // test rax, rax
+	bailIf_(0x84);                      // jz
+	untag_();
+}
+
+static void* spawn_ (Entry* entry, const std::intptr_t* args, int nargs);
+static std::intptr_t join_ (void* task, std::uintptr_t limit);
+
+void Emitter::fork (LambdaFuncData* fn, int nargs)
+{
+	retagArgs_(nargs);
+
+	// too far into the task: no task (0)
+	bytes_({ 0x48, 0x89, 0xe0 });       // mov rax, rsp
+	bytes_({ 0x4c, 0x29, 0xe0 });       // sub rax, r12
+	bytes_({ 0x48, 0x3d });             // cmp rax, StackBudget - ForkWindow
+	word_(StackBudget - ForkWindow);
+	bytes_({ 0x0f, 0x8c });             // jl
+	int deep = code_.size();
+	word_(0);
+
+	bytes_({ 0x48, 0xbf });             // mov rdi, &fn->jit
+	quad_(std::int64_t(&fn->jit));
+	bytes_({ 0x48, 0x89, 0xe6 });       // mov rsi, rsp
+	byte_(0xba);                        // mov edx, nargs
+	word_(nargs);
+	runtime_((const void*) &spawn_);
+	int done = jump();
+
+	bind(deep);
+	bytes_({ 0x31, 0xc0 });             // xor eax, eax
+	bind(done);
+	push();
+}
+
+void Emitter::join (LambdaFuncData* fn, int nargs, Operator::Kind op)
+{
+	push();
+
+	bytes_({ 0x48, 0x8b, 0x7c, 0x24, 0x08 }); // mov rdi, [rsp + 8]
+	bytes_({ 0x48, 0x85, 0xff });       // test rdi, rdi
+	bytes_({ 0x0f, 0x84 });             // jz
+	int here = code_.size();
+	word_(0);
+
+	bytes_({ 0x4c, 0x89, 0xe6 });       // mov rsi, r12
+	runtime_((const void*) &join_);
+	int done = jump();
+
+	// not started: make the call now
+	bind(here);
+	enter_(fn, 16);
+	bind(done);
+
+	bytes_({ 0x48, 0x85, 0xc0 });       // test rax, rax
+	bailIf_(0x84);                      // jz
+	untag_();
+
+	byte_(0x59);                        // pop rcx
+	bytes_({ 0x48, 0x81, 0xc4 });       // add rsp, 8 + 8 * nargs
+	word_(8 + 8 * nargs);
+	saved_ -= 2 + nargs;
+	op_(op);
+}
+
+
+static unsigned char* executable_ (const std::vector<unsigned char>& code)
+{
+#ifdef ML_JIT
+	std::size_t page = sysconf(_SC_PAGESIZE);
+	std::size_t size = (code.size() + page - 1) / page * page;
+
+	void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return nullptr;
+
+	std::memcpy(mem, code.data(), code.size());
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(mem, size);
+		return nullptr;
+	}
+	return (unsigned char*) mem;
+#else
+	return nullptr;
+#endif
+}
+
+Entry Emitter::finish (Kind k)
+{
+	if (k == Kind::Int)
+		retag_();
+	else
+	{
+		bytes_({ 0x48, 0x85, 0xc0 });   // test rax, rax
+		byte_(0xb8);                    // mov eax, false
+		word_(std::int32_t(std::intptr_t(Value::encodeBool(false))));
+		byte_(0xb9);                    // mov ecx, true
+		word_(std::int32_t(std::intptr_t(Value::encodeBool(true))));
+		bytes_({ 0x0f, 0x45, 0xc1 });   // cmovnz eax, ecx
+	}
+	leave_();
+
+	for (auto label : bails_)
+		bind(label);
+	bytes_({ 0x31, 0xc0 });             // xor eax, eax
+	leave_();
+
+	return (Entry) executable_(code_);
+}
+
+
+
+// called in place of functions that aren't compiled
+static Entry giveUp_ ()
+{
+	static Entry entry = (Entry) executable_({
+			0x31, 0xc0,                 // xor eax, eax
+			0xc3                        // ret
+		});
+	return entry;
+}
+
+static std::unordered_set<LambdaFuncData*> compiling_;
+
+static void compile_ (LambdaFuncData* fn)
+{
+	int n = fn->argNames.size();
+
+	// what calls to it find while it's compiled
+	fn->jit = giveUp_();
+
+	if (n > MaxArgs || int(fn->strict.size()) != n)
+		return;
+
+	Emitter e(fn);
+	Kind k;
+
+	compiling_.insert(fn);
+	bool ok = fn->body->jit(e, k);
+	for (auto callee : e.callees)
+	{
+		if (!ok)
+			break;
+		if (callee->jit == nullptr)
+			compile_(callee);
+		// calls to it would always give up
+		if (callee->jit == giveUp_() && compiling_.count(callee) == 0)
+			ok = false;
+	}
+	compiling_.erase(fn);
+
+	if (ok)
+		if (auto entry = e.finish(k))
+		{
+			fn->jit = entry;
+			Stats::jitCompiled++;
+		}
+}
+
+
+#ifdef ML_JIT
+
+namespace {
+
+// a call started by fork()
+struct Task
+{
+	Entry* entry; // read when it runs, in case the function gave up
+	std::intptr_t args[MaxArgs];
+	std::intptr_t result;
+	std::atomic<bool> done;
+};
+
+// a thread's tasks, newest at the back
+struct Worker
+{
+	std::mutex lock;
+	std::deque<Task*> tasks;
+};
+
+// never freed, since the workers run until the program exits
+struct Pool
+{
+	Pool () : workers(new Worker[Jit::workers + 1]), sleeping(0) {}
+
+	Worker* workers; // [0] is the interpreter's thread
+	std::mutex idleLock;
+	std::condition_variable idle;
+	std::atomic<int> sleeping;
+};
+
+}
+
+static Pool* pool_ = nullptr;
+static thread_local int self_ = 0;
+// started on this thread and not joined yet, innermost last
+static thread_local std::vector<Task*> spawned_;
+
+static std::atomic<std::size_t> tasks_(0), steals_(0);
+
+// for code called from here: measured from a frame of its own, just
+// above where that code's will be, so the caller's doesn't count
+__attribute__((noinline)) static std::uintptr_t limit_ ()
+{
+	return std::uintptr_t(__builtin_frame_address(0)) - StackBudget;
+}
+
+static void* spawn_ (Entry* entry, const std::intptr_t* args, int nargs)
+{
+	auto t = new (std::nothrow) Task;
+
+	// make the call in place instead
+	if (t == nullptr)
+		return nullptr;
+
+	t->entry = entry;
+	std::memcpy(t->args, args, nargs * sizeof(std::intptr_t));
+	t->done.store(false, std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> g(pool_->workers[self_].lock);
+		pool_->workers[self_].tasks.push_back(t);
+	}
+	spawned_.push_back(t);
+	tasks_++;
+
+	if (pool_->sleeping.load() > 0)
+		pool_->idle.notify_one();
+	return t;
+}
+
+// take back 't', if it hasn't been stolen. the tasks started after it
+// have all been taken back or joined, so it's the newest
+static bool take_ (Task* t)
+{
+	auto& w = pool_->workers[self_];
+	std::lock_guard<std::mutex> g(w.lock);
+
+	if (w.tasks.empty() || w.tasks.back() != t)
+		return false;
+	w.tasks.pop_back();
+	return true;
+}
+
+// the oldest task of another thread
+static Task* steal_ ()
+{
+	int n = workers + 1;
+
+	for (int i = 1; i < n; i++)
+	{
+		auto& w = pool_->workers[(self_ + i) % n];
+		std::lock_guard<std::mutex> g(w.lock);
+
+		if (!w.tasks.empty())
+		{
+			auto t = w.tasks.front();
+			w.tasks.pop_front();
+			steals_++;
+			return t;
+		}
+	}
+	return nullptr;
+}
+
+static void run_ (Task* t, std::uintptr_t limit);
+
+// until 't' is done elsewhere, help with other tasks
+static void wait_ (Task* t, std::uintptr_t limit)
+{
+	while (!t->done.load(std::memory_order_acquire))
+		if (auto other = steal_())
+			run_(other, limit);
+		else
+			std::this_thread::yield();
+}
+
+// after giving up, finish with the tasks started since 'mark' that
+// were never joined
+static void cancel_ (std::size_t mark, std::uintptr_t limit)
+{
+	while (spawned_.size() > mark)
+	{
+		auto t = spawned_.back();
+		spawned_.pop_back();
+		if (!take_(t))
+			wait_(t, limit);
+		delete t;
+	}
+}
+
+static void run_ (Task* t, std::uintptr_t limit)
+{
+	std::size_t mark = spawned_.size();
+
+	t->result = (*t->entry)(t->args, limit);
+	if (t->result == 0)
+		cancel_(mark, limit);
+	// whoever joins it frees it
+	t->done.store(true, std::memory_order_release);
+}
+
+static std::intptr_t join_ (void* task, std::uintptr_t limit)
+{
+	auto t = (Task*) task;
+
+	spawned_.pop_back();
+	if (take_(t))
+		run_(t, limit);
+	else
+		wait_(t, limit);
+
+	std::intptr_t result = t->result;
+	delete t;
+	return result;
+}
+
+static void work_ (int id)
+{
+	self_ = id;
+	for (int idle = 0; ; )
+		if (auto t = steal_())
+		{
+			run_(t, limit_());
+			idle = 0;
+		}
+		else if (++idle < 64)
+			std::this_thread::yield();
+		else
+		{
+			// woken by spawn_(), or now and then in case that was missed
+			std::unique_lock<std::mutex> g(pool_->idleLock);
+			pool_->sleeping++;
+			pool_->idle.wait_for(g, std::chrono::milliseconds(1));
+			pool_->sleeping--;
+		}
+}
+
+static void start_ ()
+{
+	pool_ = new Pool;
+	for (int i = 1; i <= workers; i++)
+		std::thread(work_, i).detach();
+}
+
+#else
+
+static void* spawn_ (Entry* entry, const std::intptr_t* args, int nargs) { return nullptr; }
+static std::intptr_t join_ (void* task, std::uintptr_t limit) { return 0; }
+
+#endif
+
+bool call (Value*& out, Value* func, Value** args)
+{
+	auto fn = func->lambda_;
+
+	if (!enabled)
+		return false;
+	if (fn->jit == nullptr)
+	{
+		if (++fn->calls < Threshold)
+			return false;
+		compile_(fn);
+	}
+	if (fn->jit == giveUp_())
+		return false;
+
+	std::intptr_t buf[MaxArgs];
+	for (int i = 0, n = fn->argNames.size(); i < n; i++)
+	{
+		Value* v = Value::deref(args[i]);
+
+		// a thunk the interpreter would force first; not worth
+		// counting against the function
+		if (fn->strict[i] && !(Value::isImmediate(v) &&
+				Value::typeOf(v) == Value::Type::Int))
+			return false;
+		buf[i] = std::intptr_t(v);
+	}
+
+	Stats::jitCalls++;
+	std::intptr_t result;
+#ifdef ML_JIT
+	if (workers > 0)
+	{
+		std::uintptr_t limit = limit_();
+		std::size_t mark = spawned_.size();
+
+		if (pool_ == nullptr)
+			start_();
+		result = fn->jit(buf, limit);
+		if (result == 0)
+			cancel_(mark, limit);
+		Stats::jitTasks = tasks_;
+		Stats::jitSteals = steals_;
+	}
+	else
+		result = fn->jit(buf, limit_());
+#else
+	result = 0;
+#endif
+	if (result != 0)
+	{
+		out = (Value*) result;
+		return true;
+	}
+
+	Stats::jitBails++;
+	if (++fn->bails >= MaxBails)
+		fn->jit = giveUp_();
+	return false;
+}
+
+
+};
+};
@@ -0,0 +1,123 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "Value.h"
+#include "Operator.h"
+
+namespace ml {
+
+/*
+ * Native x86-64 code for the hot top-level functions, as a tier above
+ * the tree walker and the virtual machine. A function is compiled once
+ * it has been called Threshold times, if its body only does what the
+ * compiled code knows how to: Int arithmetic the types allow, ifs, and
+ * calls that force every argument. Everything is worked out on plain
+ * machine integers, so the code never allocates.
+ *
+ * The code checks what it can't know: that arguments are Ints, that
+ * nothing overflows, and how much stack the calls take. If a check
+ * fails it gives up, and the call runs in the interpreter from the
+ * start; with no side effects, that only costs the work done so far. A
+ * function that keeps giving up is left to the interpreter.
+ *
+ * With --parallel, 'a <op> f(x)' in compiled code may start f(x) as a
+ * task on a pool of worker threads while it works out 'a', and wait
+ * for it after. Each thread keeps its own tasks, taking the newest
+ * back if no one else has; idle threads steal the oldest from the
+ * others. Compiled code touches nothing shared (the heap and the
+ * collector are for the interpreter's thread only), so this is the
+ * only place work is split. Only calls made near the start of a task,
+ * with most of the recursion still below them, are started this way,
+ * and only next to an operand that is more than a lookup; the rest
+ * are cheaper made in place.
+ *
+ * Expressions emit their own code (Expression::jit), through Emitter.
+ */
+namespace Jit {
+
+	// Entry (in Value.h) takes the arguments, each a Value*, to the
+	// result as a Value*, or 0 to run the call in the interpreter. it
+	// gives up if the stack pointer goes below 'limit'
+
+	// compile hot functions (on x86-64 Linux only)
+	extern bool enabled;
+
+	// worker threads for --parallel, 0 for none
+	extern int workers;
+
+	// calls before a function is compiled
+	const int Threshold = 64;
+	// bytes of C++ stack compiled code may take, from the interpreter
+	// or the start of a task, before giving up
+	const int StackBudget = 256 * 1024;
+	// calls are only started as tasks while the stack is this close
+	// to where the task started: about eight calls deep
+	const int ForkWindow = 512;
+	// times a function may give up before it is left alone
+	const int MaxBails = 4;
+	const int MaxArgs = 8;
+
+	// what the code for an expression leaves in the accumulator
+	enum class Kind { Int, Bool };
+
+	class Emitter
+	{
+	public:
+		explicit Emitter (LambdaFuncData* fn);
+
+		// other functions the code calls, to compile too
+		std::vector<LambdaFuncData*> callees;
+
+		// accumulator = 'n'
+		void constant (int_t n);
+		// accumulator = parameter 'slot', which must be an Int
+		void param (int slot);
+		// save the accumulator, for arith() or call()
+		void push ();
+		// accumulator = saved <op> accumulator, for Ints
+		void arith (Operator::Kind op);
+
+		// the offset of a jump, to patch with bind()
+		int jumpIfZero ();
+		int jump ();
+		void bind (int label);
+
+		// call 'fn' with the last 'nargs' saved Ints, the first
+		// argument saved last. the result must be an Int too
+		void call (LambdaFuncData* fn, int nargs, bool tail);
+
+		// for 'a <op> fn(args)', with the arguments saved as for
+		// call(): fork() may start the call as a task, then 'a' is
+		// computed, and join() waits for the call and applies 'op'
+		void fork (LambdaFuncData* fn, int nargs);
+		void join (LambdaFuncData* fn, int nargs, Operator::Kind op);
+
+		// the finished function, with its result of kind 'k'
+		Entry finish (Kind k);
+	private:
+		LambdaFuncData* self_;
+		std::vector<unsigned char> code_;
+		std::vector<int> bails_; // jumps to the bailout
+		int body_;               // where self tail calls jump to
+		int saved_;              // words pushed on the C++ stack
+
+		void byte_ (unsigned b);
+		void bytes_ (std::initializer_list<unsigned> bs);
+		void word_ (std::int32_t w);
+		void quad_ (std::int64_t q);
+		void bailIf_ (unsigned cc);
+		void retag_ ();
+		void untag_ ();
+		void leave_ ();
+		void retagArgs_ (int nargs);
+		void enter_ (LambdaFuncData* fn, int offset);
+		void runtime_ (const void* f);
+		void op_ (Operator::Kind op);
+	};
+
+	// run 'func' on 'args' as compiled code, once it's hot. false if
+	// it has to be called the usual way
+	bool call (Value*& out, Value* func, Value** args);
+};
+
+};
@@ -214,7 +214,7 @@ bool Lexer::parseId_ (Error& err)
 		}
 	
 	set_(Token::t_id, sp)
-		.val_string = ss.str();
+		.val_id = ss.str();
 	return true;
 }
 
@@ -263,7 +263,7 @@ std::string Token::str () const
 	switch (tok)
 	{
 	case t_id:
-		return val_string;
+		return val_id.str();
 	
 	case t_number:
 		ss << val_int;
@@ -3,6 +3,7 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include "Symbol.h"
 
 namespace ml {
 
@@ -64,8 +65,7 @@ struct Token
 	
 	inline Token (int tok_ = t_eof, const Span& s = Span())
 		: tok(tok_),
-			span(s),
-			val_string("") {}
+			span(s) {}
 	
 	std::string str () const;
 	
@@ -78,7 +78,7 @@ struct Token
 	
 	
 	/// internal data
-	std::string val_string;
+	Symbol val_id;
 	union {
 		int_t val_int;
 		real_t val_real;
@@ -8,3 +8,8 @@
 #include "Parser.h"
 #include "Context.h"
 #include "Environment.h"
+#include "Bytecode.h"
+#include "Stats.h"
+#include "Types.h"
+#include "Jit.h"
+#include "Aot.h"
@@ -0,0 +1,97 @@
+#pragma once
+#include "Value.h"
+#include "Context.h"
+
+namespace ml {
+
+/*
+ * The builtin arithmetic and comparison operators. Applications of
+ * them get a node (and an opcode) of their own, which computes the
+ * result in place when both sides are numbers of the same type, and
+ * only goes through the native function otherwise.
+ */
+namespace Operator {
+
+	enum Kind
+	{
+		None,
+		Add, Sub, Mul, Div,
+		Gt, Lt, Ge, Le, Eq, Ne
+	};
+
+	// which operator the native function 'func' is, if any
+	Kind of (Value* func);
+
+	// comparisons are done on reals, like the native functions do
+	static inline Value* compare_ (Context* ctx, Kind op, real_t x, real_t y)
+	{
+		switch (op)
+		{
+		case Gt: return ctx->makeBool(x > y);
+		case Lt: return ctx->makeBool(x < y);
+		case Ge: return ctx->makeBool(x >= y);
+		case Le: return ctx->makeBool(x <= y);
+		case Eq: return ctx->makeBool(x == y);
+		default: return ctx->makeBool(x != y);
+		}
+	}
+
+	// for two Ints; false on division by zero
+	static inline bool evalInt (Value*& out, Context* ctx, Kind op,
+								int_t x, int_t y)
+	{
+		switch (op)
+		{
+		case Add: out = ctx->makeInt(x + y); return true;
+		case Sub: out = ctx->makeInt(x - y); return true;
+		case Mul: out = ctx->makeInt(x * y); return true;
+		case Div:
+			if (y == 0)
+				return false;
+			out = ctx->makeReal(real_t(x) / real_t(y));
+			return true;
+		default:
+			out = compare_(ctx, op, real_t(x), real_t(y));
+			return true;
+		}
+	}
+
+	// same as calling the native function, but false if 'a' and 'b'
+	// need the general path: other types, thunks, or an error
+	static inline bool eval (Value*& out, Context* ctx, Kind op,
+								Value* a, Value* b)
+	{
+		auto t = Value::typeOf(a);
+
+		if (t != Value::typeOf(b))
+			return false;
+
+		if (t == Value::Type::Int)
+			return evalInt(out, ctx, op,
+						Value::intValue(a), Value::intValue(b));
+
+		if (t == Value::Type::Real)
+		{
+			real_t x = Value::realValue(a), y = Value::realValue(b);
+
+			switch (op)
+			{
+			case Add: out = ctx->makeReal(x + y); return true;
+			case Sub: out = ctx->makeReal(x - y); return true;
+			case Mul: out = ctx->makeReal(x * y); return true;
+			case Div:
+				if (y == 0)
+					return false;
+				out = ctx->makeReal(x / y);
+				return true;
+			default:
+				out = compare_(ctx, op, x, y);
+				return true;
+			}
+		}
+
+		return false;
+	}
+};
+
+};
@@ -4,6 +4,7 @@
 #include "Error.h"
 #include "Context.h"
 #include "Environment.h"
+#include "Types.h"
 #include <stack>
 #include <iostream>
 
@@ -95,7 +96,7 @@ bool Parser::parseEnvironment (Context* ctx, bool expectTrailing, Error& err)
 	// fn <id> <func>
 	// let <id> = <exp>
 
-	std::string name("");
+	Symbol name;
 	Exp::ptr exp;
 	Span nameSpan;
 
@@ -121,7 +122,7 @@ bool Parser::parseEnvironment (Context* ctx, bool expectTrailing, Error& err)
 	else if (!expectTrailing)
 	{
 		if (lex_.current().tok == Token::t_eof)
-			return true;
+			return link_(ctx, err);
 		err.die(lex_) << "unexpected trailing '" << lex_.current().str() << "'";
 		return false;
 	}
@@ -133,13 +134,126 @@ bool Parser::parseEnvironment (Context* ctx, bool expectTrailing, Error& err)
 		return false;
 	if (!ctx->env()->add(name, val))
 	{
-		err.die(nameSpan) << "cannot override existing '" << name << "'";
+		err.die(nameSpan) << "cannot override existing '" << name.str() << "'";
 		return false;
 	}
+	defs_.push_back({ name, val });
 	
 	return parseEnvironment(ctx, expectTrailing, err);
 }
 
+// once everything is defined, including functions that are only
+// referred to before their definition, bind references to them,
+// check the types, simplify the bodies and work out which arguments
+// can be evaluated before the call
+bool Parser::link_ (Context* ctx, Error& err)
+{
+	auto env = ctx->env();
+	std::vector<Value*> funcs;
+
+	for (auto& def : defs_)
+		if (Value::isType(def.second, Value::Type::LambdaFunc))
+		{
+			def.second->lambda_->body->link(env);
+			funcs.push_back(def.second);
+		}
+
+	if (Types::enabled)
+	{
+		Types::Infer infer(ctx);
+		if (!infer.run(funcs, err))
+			return false;
+	}
+
+	if (Exp::dumping)
+		dump_("before optimizing");
+
+	if (Exp::optimizing)
+	{
+		// inlining needs to know which calls are forced anyway
+		strictness_();
+		for (auto& def : defs_)
+			if (Value::isType(def.second, Value::Type::LambdaFunc))
+				Exp::optimize(def.second->lambda_->body, ctx, true);
+
+		if (Exp::dumping)
+			dump_("after optimizing");
+	}
+
+	strictness_();
+
+	// a body is only evaluated for its value
+	for (auto& def : defs_)
+		if (Value::isType(def.second, Value::Type::LambdaFunc))
+			def.second->lambda_->body->demand(true);
+
+	closures_();
+	return true;
+}
+
+// linked bodies refer to definitions directly, so a function only
+// needs its environment for the names still looked up through it
+void Parser::closures_ ()
+{
+	for (auto& def : defs_)
+		if (Value::isType(def.second, Value::Type::LambdaFunc))
+		{
+			auto fn = def.second->lambda_;
+			std::vector<Symbol> names;
+
+			fn->body->captures(names);
+			if (names.empty())
+				fn->env = nullptr;
+		}
+}
+
+void Parser::strictness_ ()
+{
+	std::vector<LambdaFuncData*> funcs;
+
+	for (auto& def : defs_)
+		if (Value::isType(def.second, Value::Type::LambdaFunc))
+			funcs.push_back(def.second->lambda_);
+
+	// start out assuming every parameter is forced, then drop what
+	// the bodies don't back up until nothing changes
+	for (auto fn : funcs)
+		fn->strict.assign(fn->argNames.size(), true);
+
+	for (bool changed = true; changed; )
+	{
+		changed = false;
+		for (auto fn : funcs)
+		{
+			std::vector<bool> strict(fn->argNames.size(), false);
+			fn->body->forces(strict);
+			if (strict != fn->strict)
+			{
+				fn->strict = strict;
+				changed = true;
+			}
+		}
+	}
+}
+
+void Parser::dump_ (const std::string& title)
+{
+	std::cout << "-- " << title << std::endl;
+
+	for (auto& def : defs_)
+		if (Value::isType(def.second, Value::Type::LambdaFunc))
+		{
+			auto fn = def.second->lambda_;
+
+			std::cout << "fn " << def.first.str();
+			for (auto& arg : fn->argNames)
+				std::cout << " " << arg.str();
+			std::cout << " = ";
+			fn->body->print(std::cout);
+			std::cout << std::endl;
+		}
+}
+
 bool Parser::parseFunction (Exp::ptr& out, Error& err)
 {
 	// [<id>...] = <exp>
@@ -148,7 +262,7 @@ bool Parser::parseFunction (Exp::ptr& out, Error& err)
 
 	while (lex_.current().tok == Token::t_id)
 	{
-		data.args.push_back(lex_.current().val_string);
+		data.args.push_back(lex_.current().val_id);
 		if (!lex_.advance(err))
 			return false;
 	}
@@ -167,6 +281,7 @@ bool Parser::parseIf (Exp::ptr& out, Error& err)
 	// if <exp> then <exp> else <exp>
 	
 	Exp::ptr a, b, c;
+	Span span = lex_.current().span;
 	
 	if (!eat_(Token::k_if, err) ||
 			!parseExpression(a, err) ||
@@ -177,6 +292,7 @@ bool Parser::parseIf (Exp::ptr& out, Error& err)
 		return false;
 
 	out = Exp::makeIf(a, b, c);
+	out->span = span;
 	return true;
 }
 
@@ -190,6 +306,7 @@ bool Parser::parseIf (Exp::ptr& out, Error& err)
 struct SYard
 {
 	std::stack<int> operators;
+	std::stack<Span> spans; // of the operators
 	std::stack<Exp::ptr> exps;
 
 	int precedence (int op)
@@ -215,6 +332,8 @@ struct SYard
 	   
 		op = operators.top();
 		operators.pop();
+		Span span = spans.top();
+		spans.pop();
 
 		b = exps.top();
 		exps.pop();
@@ -223,11 +342,12 @@ struct SYard
 
 		std::string opName(Token::str(op));
 		
-		exps.push(Exp::makeApplication(
-					Exp::makeVariable(opName, true),
-					{ a, b }));	
+		auto base = Exp::makeVariable(opName, true);
+		base->span = span;
+		exps.push(Exp::makeApplication(base, { a, b }));
+		exps.top()->span = span;
 	}
-	void pushOp (int op)
+	void pushOp (int op, const Span& span)
 	{
 		while (!operators.empty())
 		{
@@ -239,6 +359,7 @@ struct SYard
 		}
 
 		operators.push(op);
+		spans.push(span);
 	}
 	void pushExp (Exp::ptr exp)
 	{
@@ -285,12 +406,13 @@ bool Parser::parseSYard (Exp::ptr& out, Error& err)
 	while (isOperator_())
 	{
 		auto op = lex_.current().tok;
+		auto span = lex_.current().span;
 		if (!lex_.advance(err))
 			return false;
 		if (!parseApplication(exp, err))
 			return false;
 
-		yard.pushOp(op);
+		yard.pushOp(op, span);
 		yard.pushExp(exp);
 	}
 
@@ -318,7 +440,10 @@ bool Parser::parseApplication (Exp::ptr& out, Error& err)
 	if (args.empty())
 		out = func;
 	else
+	{
 		out = Exp::makeApplication(func, args);
+		out->span = func->span;
+	}
 	
 	return true;
 }
@@ -340,7 +465,7 @@ bool Parser::parseTerm (Exp::ptr& out, Error& err)
 			break;
 
 		case Token::t_id:
-			out = Exp::makeVariable(lex_.current().val_string);
+			out = Exp::makeVariable(lex_.current().val_id);
 			break;
 
 		case '(':
@@ -357,6 +482,7 @@ bool Parser::parseTerm (Exp::ptr& out, Error& err)
 		default:
 			return unexpected_(err);
 	}
+	out->span = lex_.current().span;
 	return lex_.advance(err);
 }
 
@@ -378,6 +504,7 @@ bool Parser::parseTuple (Exp::ptr& out, Error& err)
 	{
 		// "void" = ()
 		out = Exp::makeGenerator("void", &Context::makeVoid);
+		out->span = sp;
 		return true;
 	}
 	else if (values.size() == 1)
@@ -392,12 +519,12 @@ bool Parser::parseTuple (Exp::ptr& out, Error& err)
 	}
 }
 
-bool Parser::parseId (std::string& out, Error& err)
+bool Parser::parseId (Symbol& out, Error& err)
 {
 	if (lex_.current().tok != Token::t_id)
 		return expected_(Token::t_id, err);
 
-	out = lex_.current().val_string;
+	out = lex_.current().val_id;
 	return lex_.advance(err);
 }
 
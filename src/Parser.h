@@ -23,9 +23,16 @@ public:
 	bool parseIf (Exp::ptr& out, Error& err);
 
 	bool parseCommaExpressions (std::vector<Exp::ptr>& out, Error& err);
-	bool parseId (std::string& out, Error& err);
+	bool parseId (Symbol& out, Error& err);
+
+	// everything defined so far, in order
+	inline const std::vector<std::pair<Symbol, Value*>>& definitions () const
+	{ return defs_; }
 private:
 	Lexer& lex_;
+
+	// everything defined so far, in order
+	std::vector<std::pair<Symbol, Value*>> defs_;
 	
 	
 	bool isExp_ ();
@@ -37,6 +44,11 @@ private:
 	bool unexpected_ (Error& err);
 
 	bool eat_ (int tok, Error& err);
+
+	bool link_ (Context* ctx, Error& err);
+	void closures_ ();
+	void strictness_ ();
+	void dump_ (const std::string& title);
 };
 
 
@@ -0,0 +1,43 @@
+#include "Global.h"
+#include "Stats.h"
+
+namespace ml {
+namespace Stats {
+
+
+bool enabled = false;
+
+std::size_t forces = 0;
+std::size_t spineHighWater = 0;
+std::size_t nestHighWater = 0;
+std::size_t framesHighWater = 0;
+std::size_t collections = 0;
+std::size_t youngCollections = 0;
+std::size_t jitCompiled = 0;
+std::size_t jitCalls = 0;
+std::size_t jitBails = 0;
+std::size_t jitTasks = 0;
+std::size_t jitSteals = 0;
+std::size_t callHits = 0;
+std::size_t callMisses = 0;
+
+
+void dump (std::ostream& os)
+{
+	os << "stats :: forces: " << forces << std::endl
+	   << "stats :: spine high-water: " << spineHighWater << std::endl
+	   << "stats :: nested forces high-water: " << nestHighWater << std::endl
+	   << "stats :: vm frames high-water: " << framesHighWater << std::endl
+	   << "stats :: collections: " << collections
+	   << " (" << youngCollections << " young)" << std::endl
+	   << "stats :: jit: " << jitCompiled << " compiled, " << jitCalls
+	   << " calls, " << jitBails << " bailed" << std::endl
+	   << "stats :: jit tasks: " << jitTasks << " started, "
+	   << jitSteals << " stolen" << std::endl
+	   << "stats :: call site cache: " << callHits << " hits, "
+	   << callMisses << " misses" << std::endl;
+}
+
+
+};
+};
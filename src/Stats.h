@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <iostream>
+
+namespace ml {
+
+/*
+ * Counters kept while the program runs, printed by --stats. They are
+ * plain globals, cheap enough to keep up to date whether or not they
+ * get printed.
+ */
+namespace Stats {
+
+	extern bool enabled;
+
+	extern std::size_t forces;          // calls to Value::partialEval
+	extern std::size_t spineHighWater;  // most arguments on one spine
+	extern std::size_t nestHighWater;   // most forces in progress at once
+	extern std::size_t framesHighWater; // most frames in the VM at once
+	extern std::size_t collections;
+	extern std::size_t youngCollections;
+	extern std::size_t jitCompiled;     // functions compiled to native code
+	extern std::size_t jitCalls;        // calls run as native code
+	extern std::size_t jitBails;        // of those, given up on
+	extern std::size_t jitTasks;        // calls started as tasks (--parallel)
+	extern std::size_t jitSteals;       // of those, run by another thread
+	extern std::size_t callHits;        // call site caches that knew the callee
+	extern std::size_t callMisses;
+
+	// raise a high-water mark
+	inline void peak (std::size_t& mark, std::size_t n)
+	{
+		if (n > mark)
+			mark = n;
+	}
+
+	void dump (std::ostream& os);
+};
+
+};
@@ -0,0 +1,29 @@
+#include "Global.h"
+#include "Symbol.h"
+#include <unordered_set>
+
+namespace ml {
+
+
+// node based, so the strings never move
+static std::unordered_set<std::string>& table ()
+{
+	static std::unordered_set<std::string> t;
+	return t;
+}
+
+Symbol::Symbol ()
+{
+	// made for every token, so skip the lookup
+	static const std::string* empty = &*table().insert("").first;
+	name_ = empty;
+}
+
+Symbol::Symbol (const std::string& name)
+	: name_(&*table().insert(name).first) {}
+
+Symbol::Symbol (const char* name)
+	: Symbol(std::string(name)) {}
+
+
+};
@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+#include <cstddef>
+#include <functional>
+
+namespace ml {
+
+/*
+ * An interned identifier. Every Symbol made from the same name
+ * points at the same string, so symbols compare (and hash) as
+ * pointers. The table is never emptied.
+ */
+class Symbol
+{
+public:
+	Symbol ();
+	Symbol (const std::string& name);
+	Symbol (const char* name);
+
+	inline const std::string& str () const { return *name_; }
+	inline std::size_t id () const { return std::size_t(name_); }
+
+	inline bool operator== (const Symbol& o) const { return name_ == o.name_; }
+	inline bool operator!= (const Symbol& o) const { return name_ != o.name_; }
+	inline bool operator< (const Symbol& o) const { return name_ < o.name_; }
+
+	struct Hash
+	{
+		inline std::size_t operator() (const Symbol& s) const
+		{ return std::hash<std::size_t>()(s.id()); }
+	};
+private:
+	const std::string* name_;
+};
+
+};
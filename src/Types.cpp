@@ -0,0 +1,310 @@
+#include "Global.h"
+#include "Types.h"
+#include "Context.h"
+#include "Expression.h"
+#include "Operator.h"
+#include "Error.h"
+#include <map>
+#include <sstream>
+#include <algorithm>
+
+namespace ml {
+namespace Types {
+
+
+bool enabled = true;
+
+
+Type* resolve (Type* t)
+{
+	while (t->link)
+		t = t->link;
+	return t;
+}
+
+bool isInt (Type* t)
+{
+	t = resolve(t);
+	return t->kind == Type::Kind::Number && !t->real;
+}
+
+
+static void str_ (std::ostream& os, Type* t, std::map<Type*, int>& names)
+{
+	t = resolve(t);
+
+	switch (t->kind)
+	{
+	case Type::Kind::Var:
+	{
+		auto it = names.insert({ t, int(names.size()) }).first;
+		os << "'" << char('a' + it->second % 26);
+		if (it->second >= 26)
+			os << it->second / 26;
+		break;
+	}
+	case Type::Kind::Number: os << (t->real ? "Real" : "Number"); break;
+	case Type::Kind::Bool: os << "Bool"; break;
+	case Type::Kind::Void: os << "Void"; break;
+	case Type::Kind::Func:
+	{
+		bool nested = resolve(t->from)->kind == Type::Kind::Func;
+		if (nested) os << "(";
+		str_(os, t->from, names);
+		if (nested) os << ")";
+		os << " -> ";
+		str_(os, t->to, names);
+		break;
+	}
+	}
+}
+
+std::string str (Type* t)
+{
+	std::ostringstream ss;
+	std::map<Type*, int> names;
+	str_(ss, t, names);
+	return ss.str();
+}
+
+
+
+Infer::Infer (Context* c)
+	: ctx(c), params(nullptr), level_(0) {}
+
+Type* Infer::basic (Type::Kind k)
+{
+	types_.push_back({ k, nullptr, false, false, level_, nullptr, nullptr });
+	return &types_.back();
+}
+Type* Infer::var () { return basic(Type::Kind::Var); }
+Type* Infer::number (bool real)
+{
+	auto t = basic(Type::Kind::Number);
+	t->real = real;
+	return t;
+}
+Type* Infer::func (Type* from, Type* to)
+{
+	auto t = basic(Type::Kind::Func);
+	t->from = from;
+	t->to = to;
+	return t;
+}
+
+Type* Infer::of (Value* v)
+{
+	switch (Value::typeOf(v))
+	{
+	case Value::Type::Int: return number(false);
+	case Value::Type::Real: return number(true);
+	case Value::Type::Bool: return basic(Type::Kind::Bool);
+	case Value::Type::Void: return basic(Type::Kind::Void);
+	default: return var();
+	}
+}
+
+
+// the builtins, as the native functions check them at runtime
+Type* Infer::native_ (Value* f)
+{
+	using namespace Operator;
+
+	switch (Operator::of(f))
+	{
+	case Add: case Sub: case Mul:
+	{
+		// an Int and a Real make a Real
+		auto n = number(false);
+		return func(n, func(n, n));
+	}
+	case Div:
+		return func(number(false), func(number(false), number(true)));
+	case Gt: case Lt: case Ge: case Le:
+		return func(number(false), func(number(false),
+						basic(Type::Kind::Bool)));
+	case Eq: case Ne:
+		// anything can be compared
+		return func(var(), func(var(), basic(Type::Kind::Bool)));
+	default:
+		return var();
+	}
+}
+
+bool Infer::use (Type*& out, Value* f, Error& err)
+{
+	if (Value::isType(f, Value::Type::NativeFunc))
+	{
+		out = native_(f);
+		return true;
+	}
+
+	if (!Value::isType(f, Value::Type::LambdaFunc))
+	{
+		out = of(f);
+		return true;
+	}
+
+	if (schemes_.count(f) == 0 && !infer_(f, err))
+		return false;
+
+	// recursive uses see the type still being worked out
+	if (inferring_.count(f))
+		out = schemes_[f];
+	else
+	{
+		std::unordered_map<Type*, Type*> vars;
+		out = instantiate_(schemes_[f], vars);
+	}
+	return true;
+}
+
+
+bool Infer::run (const std::vector<Value*>& funcs, Error& err)
+{
+	for (auto f : funcs)
+		if (schemes_.count(f) == 0 && !infer_(f, err))
+			return false;
+
+	for (auto& fn : finish)
+		fn();
+	return true;
+}
+
+bool Infer::infer_ (Value* f, Error& err)
+{
+	auto fn = f->lambda_;
+	std::vector<Type*> args;
+
+	level_++;
+
+	// curried, like partial application works
+	for (std::size_t i = 0; i < fn->argNames.size(); i++)
+		args.push_back(var());
+	Type* result = var();
+	Type* t = result;
+	for (auto it = args.rbegin(); it != args.rend(); ++it)
+		t = func(*it, t);
+
+	schemes_[f] = t;
+	inferring_.insert(f);
+
+	auto outer = params;
+	Type* body;
+	params = &args;
+	bool ok = fn->body->infer(body, *this, err) &&
+		unify(result, body, fn->body->span, err);
+	params = outer;
+
+	inferring_.erase(f);
+	level_--;
+
+	if (ok)
+		generalize_(t);
+	return ok;
+}
+
+
+Type* Infer::instantiate_ (Type* t, std::unordered_map<Type*, Type*>& vars)
+{
+	t = resolve(t);
+
+	switch (t->kind)
+	{
+	case Type::Kind::Var:
+		if (!t->generic)
+			return t;
+		if (vars.count(t) == 0)
+			vars[t] = var();
+		return vars[t];
+
+	case Type::Kind::Func:
+		return func(instantiate_(t->from, vars), instantiate_(t->to, vars));
+
+	default:
+		// numbers are shared by every use
+		return t;
+	}
+}
+
+void Infer::generalize_ (Type* t)
+{
+	t = resolve(t);
+
+	if (t->kind == Type::Kind::Var && t->level > level_)
+		t->generic = true;
+	else if (t->kind == Type::Kind::Func)
+	{
+		generalize_(t->from);
+		generalize_(t->to);
+	}
+}
+
+
+bool Infer::occurs_ (Type* v, Type* t)
+{
+	t = resolve(t);
+
+	if (t == v)
+		return true;
+	if (t->kind == Type::Kind::Var)
+	{
+		// 'v' is bound to it, so it's no longer any deeper than 'v'
+		t->level = std::min(t->level, v->level);
+		return false;
+	}
+	if (t->kind == Type::Kind::Func)
+		return occurs_(v, t->from) || occurs_(v, t->to);
+	return false;
+}
+
+bool Infer::unify_ (Type* a, Type* b)
+{
+	a = resolve(a);
+	b = resolve(b);
+
+	if (a == b)
+		return true;
+
+	if (b->kind == Type::Kind::Var)
+		std::swap(a, b);
+	if (a->kind == Type::Kind::Var)
+	{
+		if (occurs_(a, b))
+			return false;
+		a->link = b;
+		return true;
+	}
+
+	if (a->kind != b->kind)
+		return false;
+
+	switch (a->kind)
+	{
+	case Type::Kind::Number:
+		b->real = b->real || a->real;
+		a->link = b;
+		return true;
+
+	case Type::Kind::Func:
+		return unify_(a->from, b->from) && unify_(a->to, b->to);
+
+	default:
+		return true;
+	}
+}
+
+bool Infer::unify (Type* expected, Type* actual, const Span& span,
+					Error& err)
+{
+	if (unify_(expected, actual))
+		return true;
+
+	err.die(span) << "type mismatch, expected " << str(expected)
+	              << " but got " << str(actual);
+	return false;
+}
+
+
+};
+};
@@ -0,0 +1,89 @@
+#pragma once
+#include "Lexer.h"
+#include "Value.h"
+#include <deque>
+#include <vector>
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace ml {
+
+/*
+ * Hindley-Milner type inference over the top-level functions, run once
+ * they are linked. The language itself stays dynamically typed; this
+ * reports the errors that are sure to happen before anything runs, and
+ * tells the evaluator which arithmetic is only ever done on Ints.
+ *
+ * Numbers are where it differs from plain HM. An Int may be used where
+ * a Real is expected, as the builtins allow, so there is one kind of
+ * number type, which remembers whether a Real can flow into it. Number
+ * types are never generalized, so every use of a function agrees on
+ * them: one that no Real reaches only ever holds Ints.
+ */
+namespace Types {
+
+	struct Type
+	{
+		enum class Kind { Var, Number, Bool, Void, Func };
+
+		Kind kind;
+		Type* link;      // Var, Number: bound to another type
+		bool real;       // Number: may be a Real
+		bool generic;    // Var: copied on each use
+		int level;       // Var: how deep in the functions it was made
+		Type* from, *to; // Func
+	};
+
+	// what 't' is bound to
+	Type* resolve (Type* t);
+	// sure to only ever be an Int
+	bool isInt (Type* t);
+	std::string str (Type* t);
+
+	// check types before running
+	extern bool enabled;
+
+	class Infer
+	{
+	public:
+		explicit Infer (Context* c);
+
+		Context* ctx;
+		// parameters of the function being inferred, by slot
+		std::vector<Type*>* params;
+		// run once every function has been inferred, when the types
+		// are as complete as they get
+		std::vector<std::function<void ()>> finish;
+
+		Type* var ();
+		Type* number (bool real);
+		Type* basic (Type::Kind k);
+		Type* func (Type* from, Type* to);
+		// the type of a constant
+		Type* of (Value* v);
+
+		// the type of a reference to the function 'f'
+		bool use (Type*& out, Value* f, Error& err);
+		// 'actual' where 'expected' is needed
+		bool unify (Type* expected, Type* actual, const Span& span,
+						Error& err);
+
+		bool run (const std::vector<Value*>& funcs, Error& err);
+	private:
+		std::deque<Type> types_;
+		int level_;
+		std::unordered_map<Value*, Type*> schemes_;
+		std::unordered_set<Value*> inferring_;
+
+		bool infer_ (Value* f, Error& err);
+		Type* native_ (Value* f);
+		Type* instantiate_ (Type* t, std::unordered_map<Type*, Type*>& vars);
+		void generalize_ (Type* t);
+		bool occurs_ (Type* v, Type* t);
+		bool unify_ (Type* a, Type* b);
+	};
+};
+
+};
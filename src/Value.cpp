@@ -5,32 +5,55 @@
 #include "Error.h"
 #include "Expression.h"
 #include "ValueAllocator.h"
+#include "Bytecode.h"
+#include "Jit.h"
 #include <sstream>
 #include <iostream>
 #include <iomanip>
 #include <memory>
+#include <cstring>
+#include "Stats.h"
 #include "left_vector.hpp"
 
 namespace ml {
 
 
 
-Value::Value (Type t, Context* ctx)
-	: type(t), owner(ctx)
-#ifdef ML_USE_CUSTOM_ALLOCATOR
-	  ,allocator(nullptr)
-#endif
+Value::Value (Type t)
+	: type(t), marked(false), old(false), allocator(nullptr)
 { }
 
 Value::~Value ()
 {
-#ifdef ML_USE_CUSTOM_ALLOCATOR
 	if (allocator != nullptr)
 		destroy();
-#endif
 }
 
 void Value::destroy ()
+{
+	finalize();
+
+	if (allocator)
+	{
+		// the slab may be released by destroyed()
+		auto a = allocator;
+		allocator = nullptr;
+		a->destroyed(this);
+	}
+}
+
+void Value::update (Value* val)
+{
+	finalize();
+	type = Type::Indirect;
+	ind_ = val;
+
+	// old Values aren't traced by minor collections
+	if (old)
+		Context::remember(this);
+}
+
+void Value::finalize ()
 {
 	switch (type)
 	{
@@ -53,24 +76,54 @@ void Value::destroy ()
 
 	default: break;
 	}
+	type = Type::Void;
+}
 
-#ifdef ML_USE_CUSTOM_ALLOCATOR
-	if (allocator)
+
+// Reals are rotated left by a bit, moving the sign to the bottom,
+// and get their exponent rebased so that it fits in 8 bits
+static const std::uint64_t RealExpOffset = std::uint64_t(896) << 53;
+
+Value* Value::encodeReal (real_t n)
+{
+	if (sizeof(std::uintptr_t) < sizeof(std::uint64_t))
+		return nullptr;
+
+	std::uint64_t b;
+	std::memcpy(&b, &n, sizeof(b));
+	std::uint64_t r = (b << 1) | (b >> 63);
+
+	// +0.0 and -0.0 are kept as is
+	if (r > 1)
 	{
-		allocator->destroyed(this);
-		allocator = nullptr;
+		r -= RealExpOffset;
+		if (r < (std::uint64_t(1) << 53) ||
+				r >= (std::uint64_t(1) << 61))
+			return nullptr;
 	}
-#else
-	delete this;
-#endif
+
+	return make_(std::uintptr_t(r << 3) | RealTag);
+}
+real_t Value::decodeReal_ (std::uintptr_t bits)
+{
+	std::uint64_t r = std::uint64_t(bits) >> 3;
+	if (r > 1)
+		r += RealExpOffset;
+
+	std::uint64_t b = (r >> 1) | (r << 63);
+	real_t n;
+	std::memcpy(&n, &b, sizeof(n));
+	return n;
 }
 
 
-bool Value::isType (Type t) const
+bool Value::isType (const Value* v, Type t)
 {
 	if (t == Type::Any)
 		return true;
 
+	Type type = typeOf(v);
+
 	if (t == Type::Number)
 		return type == Type::Int ||
 				type == Type::Real;
@@ -84,9 +137,11 @@ bool Value::isType (Type t) const
 }
 
 
-std::string Value::str () const
+std::string Value::str (const Value* v)
 {
 	std::ostringstream ss;
+	v = deref(v);
+	Type type = typeOf(v);
 
 	switch (type)
 	{
@@ -94,14 +149,17 @@ std::string Value::str () const
 		return "()";
 
 	case Type::Int:
-		ss << int_.value;
+		ss << intValue(v);
 		return ss.str();
 
 	case Type::Real:
-		ss << std::setprecision(10) << real_.value;
-		if ((int_t)(real_.value) == real_.value)
+	{
+		real_t n = realValue(v);
+		ss << std::setprecision(10) << n;
+		if ((int_t)(n) == n)
 			ss << ".0"; // fuck
 		return ss.str();
+	}
 
 	case Type::Environment:
 		return "<Environment>";
@@ -111,12 +169,12 @@ std::string Value::str () const
 	case Type::PartialFunc:
 		ss << "<Function";
 		if (type == Type::NativeFunc)
-			ss << " '" << *native_.name << "'";
+			ss << " '" << *v->native_.name << "'";
 		ss << ">";
 		return ss.str();
 	
 	case Type::Bool:
-		if (bool_)
+		if (boolValue(v))
 			return "true";
 		else
 			return "false";
@@ -140,70 +198,91 @@ std::string Value::str (Type t)
 	case Type::NativeFunc:
 	case Type::Func: return "Func";
 	case Type::PartialFunc: return "PartialFunc";
+	case Type::Indirect: return "Indirect";
 	case Type::Any: 
 	default: return "Any";
 	}
 }
 
-int Value::numArgs () const
+int Value::numArgs (const Value* v)
 {
-	if (type == Type::NativeFunc)
-		return native_.nargs;
+	v = deref(v);
+	if (isImmediate(v))
+		return 0;
+
+	if (v->type == Type::NativeFunc)
+		return v->native_.nargs;
 	
-	if (type == Type::LambdaFunc)
-		return lambda_->argNames.size();
+	if (v->type == Type::LambdaFunc)
+		return v->lambda_->argNames.size();
 
-	if (type == Type::PartialFunc)
-		return partial_.base->numArgs() - partial_.nargs;
+	if (v->type == Type::PartialFunc)
+		return numArgs(v->partial_.base) - v->partial_.nargs;
 
 	return 0;
 }
 
 
-bool Value::trivialEval () const
+bool Value::trivialEval (const Value* v)
 {
-	if (type == Type::PartialFunc)
+	v = deref(v);
+	if (isImmediate(v))
+		return true;
+
+	if (v->type == Type::PartialFunc)
 	{
-		switch (partial_.base->type)
+		switch (typeOf(deref(v->partial_.base)))
 		{
 		case Type::LambdaFunc:
 		case Type::NativeFunc:
-			return partial_.nargs < partial_.base->numArgs();
+			return v->partial_.nargs < numArgs(v->partial_.base);
 
 		default:
 			return false;
 		}
 	}
 
-	if (type == Type::LambdaFunc ||
-			type == Type::NativeFunc)
-		return numArgs() > 0;
+	if (v->type == Type::LambdaFunc ||
+			v->type == Type::NativeFunc)
+		return numArgs(v) > 0;
 
 	return true;
 }
-bool Value::eval (Value*& out, Context* ctx, Error& err)
+bool Value::eval (Value*& out, Context* ctx, Value* v, Error& err)
 {
 	/// optimization
-	if (trivialEval())
+	if (trivialEval(v))
 	{
-		out = this;
+		out = deref(v);
 		return true;
 	}
 	else
-		return partialEval(out, ctx, this, err);
+		return partialEval(out, ctx, v, err);
 }
 
 bool Value::apply (Value*& out, Context* ctx, Value** args, Error& err)
 {
 	if (type == Type::NativeFunc)
 	{
-		auto buf = std::unique_ptr<Value*[]>(new Value*[native_.nargs]);
+		// builtins take few arguments, so they are evaluated into a
+		// buffer on the stack rather than one allocated per call
+		Value* inlineBuf[MaxInlineArgs] = { nullptr };
+		std::vector<Value*> heapBuf;
+		Value** buf = inlineBuf;
+
+		if (native_.nargs > MaxInlineArgs)
+		{
+			heapBuf.resize(native_.nargs, nullptr);
+			buf = heapBuf.data();
+		}
+		Context::Root root(buf, native_.nargs);
+
 		for (int i = 0; i < native_.nargs; i++)
 		{
-			if (!args[i]->eval(buf[i], ctx, err))
+			if (!eval(buf[i], ctx, args[i], err))
 				return false;
 
-			if (!buf[i]->isType(native_.types[i]))
+			if (!isType(buf[i], native_.types[i]))
 			{
 				// TODO: make this error message not complete shit
 				err.die(ctx) << "invalid argument #" << (i + 1) << " to function '"
@@ -213,55 +292,107 @@ bool Value::apply (Value*& out, Context* ctx, Value** args, Error& err)
 			}
 		}
 		
-		return native_.handler(out, ctx, buf.get(), err);
+		return native_.handler(out, ctx, buf, err);
 	}
 
 	if (type == Type::LambdaFunc)
 	{
-		Context subcontext(lambda_->env);
-		Environment* subenv = subcontext.env();
-		
-		int i = 0;
-		for (auto& arg : lambda_->argNames)
-			subenv->add(arg, args[i++]);
+		if (Jit::call(out, this, args))
+			return true;
+		if (Bytecode::enabled)
+			return Bytecode::call(out, ctx, this, args, err);
+
+		// the frame binds the arguments in place, and is gone
+		// as a whole once the body has been evaluated
+		Environment frame(lambda_->env, lambda_->argNames, args);
+		Context subcontext(&frame);
 		
-		if (!lambda_->body->eval(out, &subcontext, err))
-			return false;
-
-		ctx->takeControl(out, &subcontext);
-		return true;
+		return lambda_->body->eval(out, &subcontext, err);
 	}
 
 
-	err.die(ctx) << "cannot apply value " << str();
+	err.die(ctx) << "cannot apply value " << str(this);
 	return false;
 }
 
+// the spines of the forces in progress, innermost last. they are kept
+// once grown, so forcing doesn't allocate. forces only nest through
+// native calls and conditions, so there are few of them
+static std::vector<std::unique_ptr<left_vector<Value*>>> spines_;
+static std::size_t nested_ = 0;
+
+namespace {
+	struct Spine
+	{
+		left_vector<Value*>& args;
+
+		Spine ()
+			: args(take_())
+		{
+			args.clear();
+		}
+		~Spine () { nested_--; }
+
+		static left_vector<Value*>& take_ ()
+		{
+			if (nested_ == spines_.size())
+				spines_.emplace_back(new left_vector<Value*>());
+			Stats::peak(Stats::nestHighWater, nested_ + 1);
+			return *spines_[nested_++];
+		}
+	};
+}
+
 bool Value::partialEval (Value*& out, Context* ctx, Value* base, Error& err)
 {
-	left_vector<Value*> args;
+	Stats::forces++;
+
+	if (Bytecode::enabled)
+		return Bytecode::eval(out, ctx, base, err);
+
+	Spine spine;
+	auto& args = spine.args;
 	unsigned int nargs;
-	int gctimer = 0;
+	// the thunk being forced, which gets updated with the result
+	Value* thunk = nullptr;
+	Context::Root argsRoot(args), baseRoot(base), thunkRoot(thunk);
 
 	for (;;)
 	{
-		switch (base->type)
+		switch (typeOf(base))
 		{
+		case Type::Indirect:
+			base = base->ind_;
+			break;
+
 		case Type::PartialFunc:
+			if (args.size() == 0 && !trivialEval(base))
+			{
+				// the value of the previous thunk is the value of this
+				// one. the collector shortens the chain, so a loop does
+				// not hold on to every thunk it went through
+				if (thunk)
+					thunk->update(base);
+				thunk = base;
+			}
+
 			args.insert(base->partial_.args,
 					    base->partial_.nargs);
+			Stats::peak(Stats::spineHighWater, args.size());
 			
 			base = base->partial_.base;
 			break;
 
 		case Type::LambdaFunc:
 		case Type::NativeFunc:
-			nargs = base->numArgs();
+			nargs = numArgs(base);
 
 			if (args.size() < nargs)
 			{
 				// create partial application
 				out = ctx->apply(base, args.data(), args.size());
+				if (thunk)
+					thunk->update(out);
 				return true;	
 			}
 			else
@@ -277,37 +408,34 @@ bool Value::partialEval (Value*& out, Context* ctx, Value* base, Error& err)
 			if (args.size() == 0)
 			{
 				out = base;
+				if (thunk)
+					thunk->update(out);
 				return true;
 			}
 			else
 			{
-				err.die(ctx) << "cannot apply value " << base->str();
+				err.die(ctx) << "cannot apply value " << str(base);
 				return false;
 			}
 		}
-		if (++gctimer > 256)
-		{
-			gctimer = 0;
-			std::vector<Value*> keep(args.begin(), args.end());
-			keep.push_back(base);
-			ctx->collectGarbage(keep);
-		}
+		Context::safepoint();
 	}
 }
 
 
-bool Value::condition () const
+bool Value::condition (const Value* v)
 {
-	switch (type)
+	v = deref(v);
+	switch (typeOf(v))
 	{
 	case Type::Int:
-		return int_.value != 0;
+		return intValue(v) != 0;
 	
 	case Type::Real:
-		return real_.value != 0;
+		return realValue(v) != 0;
 
 	case Type::Bool:
-		return bool_;
+		return boolValue(v);
 
 	case Type::Void:
 		return false;
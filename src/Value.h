@@ -2,6 +2,8 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <cstdint>
+#include "Symbol.h"
 
 namespace ml {
 
@@ -11,12 +13,27 @@ class Environment;
 class Error;
 class Expression;
 struct Value;
+namespace Bytecode { struct Code; }
+namespace Jit { typedef std::intptr_t (*Entry) (const std::intptr_t* args, std::uintptr_t limit); }
 
 struct LambdaFuncData
 {
-	std::vector<std::string> argNames;
+	std::vector<Symbol> argNames;
 	std::shared_ptr<Expression> body;
+	// where it was made; nullptr once linked if the body doesn't
+	// look any names up through it
 	Value* env;
+
+	// compiled body, shared by every function made from the same
+	// lambda. compiled on the first call, if needed at all
+	std::shared_ptr<Bytecode::Code> code;
+
+	// which parameters the body is sure to force, if known
+	std::vector<bool> strict;
+
+	// native code, once there have been enough calls (see Jit.h)
+	Jit::Entry jit;
+	int calls, bails;
 };
 
 struct Value
@@ -33,6 +50,7 @@ struct Value
 		NativeFunc,
 		LambdaFunc,
 		PartialFunc,
+		Indirect, // a forced thunk, standing in for its value
 
 		// auxillary
 		Number,
@@ -41,44 +59,123 @@ struct Value
 	};	
 	
 	
-	Value (Type t = Type::Void, Context* ctx = nullptr);
+	Value (Type t = Type::Void);
 	~Value ();
 	void destroy ();
+	void finalize (); // free owned data only
+
+
+	/*
+	 * Ints, Reals, Bools and Void are normally not allocated
+	 * at all, but encoded in the Value* itself:
+	 *
+	 *   ...xxx1  Int (63 bits)
+	 *   ...x010  Real (exponent range cut down to 8 bits)
+	 *   ...x100  Bool / Void
+	 *   ...x000  pointer to an actual Value
+	 *
+	 * Numbers that do not fit are boxed as usual. Since any Value*
+	 * may be an immediate, Values are inspected through the static
+	 * functions below; only Values known to be on the heap (e.g.
+	 * functions) may be dereferenced directly.
+	 */
+	static inline bool isImmediate (const Value* v)
+	{ return (bits_(v) & TagMask) != 0; }
+
+	static inline Type typeOf (const Value* v)
+	{
+		switch (bits_(v) & TagMask)
+		{
+		case 0:
+			return v->type;
+		case RealTag:
+			return Type::Real;
+		case SpecialTag:
+			return bits_(v) == VoidBits ? Type::Void : Type::Bool;
+		default:
+			return Type::Int;
+		}
+	}
 
-	bool isType (Type t) const;
+	static inline int_t intValue (const Value* v)
+	{
+		if (bits_(v) & IntTag)
+			return int_t(std::intptr_t(bits_(v)) >> 1);
+		else
+			return v->int_.value;
+	}
+	static inline real_t realValue (const Value* v)
+	{
+		if ((bits_(v) & TagMask) == RealTag)
+			return decodeReal_(bits_(v));
+		else
+			return v->real_.value;
+	}
+	static inline bool boolValue (const Value* v)
+	{ return bits_(v) == TrueBits; }
 
-	std::string str () const;
-	static std::string str (Type t);
+	template <typename T=real_t>
+	static inline T numberValue (const Value* v)
+	{	if (typeOf(v) == Type::Int)
+			return (T) intValue(v);
+		else
+			return (T) realValue(v);
+	}
 
-	bool trivialEval () const;
-	bool eval (Value*& out, Context* ctx, Error& err);
-	
+	// these return nullptr if the number does not fit
+	static inline Value* encodeInt (int_t n)
+	{
+		if (n < IntMin || n > IntMax)
+			return nullptr;
+		return make_((std::uintptr_t(n) << 1) | IntTag);
+	}
+	static Value* encodeReal (real_t n);
 
-	// assumes correct number of arguments
-	bool apply (Value*& out, Context* ctx, Value** args, Error& err);
-	int numArgs () const;
+	static inline Value* encodeBool (bool b)
+	{ return make_(b ? TrueBits : FalseBits); }
+	static inline Value* encodeVoid ()
+	{ return make_(VoidBits); }
 
 
-	template <typename T=real_t>
-	inline T numberValue ()
-	{	if (type == Type::Int)
-			return (T) int_.value;
-		else
-			return (T) real_.value;
+	static bool isType (const Value* v, Type t);
+
+	// look through forced thunks
+	static inline Value* deref (Value* v)
+	{
+		while (!isImmediate(v) && v->type == Type::Indirect)
+			v = v->ind_;
+		return v;
 	}
+	static inline const Value* deref (const Value* v)
+	{ return deref(const_cast<Value*>(v)); }
+	// overwrite a thunk with the value it was forced to
+	void update (Value* val);
+
+	static std::string str (const Value* v);
+	static std::string str (Type t);
+
+	// forcing 'v' would not do any work. forced thunks count as
+	// trivial, but have to be deref()'d (eval() does so)
+	static bool trivialEval (const Value* v);
+	static bool eval (Value*& out, Context* ctx, Value* v, Error& err);
+
+
+	// assumes correct number of arguments. lambdas bind 'args'
+	// in place, so it has to stay put for the whole call
+	bool apply (Value*& out, Context* ctx, Value** args, Error& err);
+	static int numArgs (const Value* v);
+
+	static bool condition (const Value* v);
 
-	bool condition () const;
-	
 	static bool partialEval (Value*& out, Context* ctx,
 						Value* base, Error& err);
 
 
 
 	Type type;
-	Context* owner;
-#ifdef ML_USE_CUSTOM_ALLOCATOR
-	ValueAllocator* allocator;
-#endif
+	bool marked; // by the garbage collector
+	bool old;    // survived a collection
+	ValueAllocator* allocator; // null if not managed by the collector
 	
 	union
 	{
@@ -103,11 +200,40 @@ struct Value
 			Type* types;
 			std::string* name;
 		} native_;
-		bool bool_;
 
 		Environment* env_;
 		LambdaFuncData* lambda_;
+		Value* ind_;
+
+		// used by ValueAllocator while dead
+		Value* nextFree_;
 	};
+
+private:
+	enum : std::uintptr_t
+	{
+		TagMask = 7,
+		IntTag = 1,
+		RealTag = 2,
+		SpecialTag = 4,
+
+		FalseBits = (0 << 3) | SpecialTag,
+		TrueBits = (1 << 3) | SpecialTag,
+		VoidBits = (2 << 3) | SpecialTag
+	};
+	static constexpr int_t IntMax = int_t(INTPTR_MAX >> 1);
+	static constexpr int_t IntMin = int_t(INTPTR_MIN >> 1);
+
+	// native functions with at most this many arguments are called
+	// without allocating
+	static constexpr int MaxInlineArgs = 4;
+
+	static inline std::uintptr_t bits_ (const Value* v)
+	{ return reinterpret_cast<std::uintptr_t>(v); }
+	static inline Value* make_ (std::uintptr_t bits)
+	{ return reinterpret_cast<Value*>(bits); }
+
+	static real_t decodeReal_ (std::uintptr_t bits);
 };
 
 
@@ -1,18 +1,69 @@
 #include "Global.h"
 #include "ValueAllocator.h"
 #include <iostream>
+#include <new>
+
+#ifdef _WIN32
+# include <malloc.h>
+#else
+# include <sys/mman.h>
+#endif
 
 namespace ml {
 
-#ifdef ML_USE_CUSTOM_ALLOCATOR
 
-ValueAllocator::ValueAllocator ()
-	: slab(new Value[NumValues]),
-	  left(0),
-	  next(nullptr)
+// slabs have to be aligned to their size
+static void* mapSlab (std::size_t size)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, size);
+#else
+	// over-map, then trim down to an aligned block
+	auto raw = (char*) mmap(nullptr, size * 2, PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == (char*) MAP_FAILED)
+		return nullptr;
+
+	auto base = (char*) ((std::uintptr_t(raw) + size - 1) & ~(size - 1));
+	if (base > raw)
+		munmap(raw, base - raw);
+	munmap(base + size, (raw + size * 2) - (base + size));
+	return base;
+#endif
+}
+static void unmapSlab (void* slab, std::size_t size)
+{
+#ifdef _WIN32
+	_aligned_free(slab);
+#else
+	munmap(slab, size);
+#endif
+}
+
+
+
+ValueAllocator::ValueAllocator (int slabSize, int nurserySize)
+	: slabBytes_(4096),
+	  numSlabs_(0),
+	  nurserySize_(nurserySize),
+	  young_(0),
+	  old_(0),
+	  threshold_(MinCollectThreshold),
+	  nursery_(nullptr),
+	  partial_(nullptr),
+	  full_(nullptr),
+	  spare_(nullptr),
+	  numSpare_(0)
 {
-	for (int i = 0; i < NumValues; i++)
-		slab[i].allocator = nullptr;
+	if (slabSize < 1)
+		slabSize = 1;
+
+	std::size_t need = sizeof(Slab) + slabSize * sizeof(Value);
+	while (slabBytes_ < need)
+		slabBytes_ *= 2;
+
+	// fill up the rounded size
+	slabValues_ = (slabBytes_ - sizeof(Slab)) / sizeof(Value);
 
 	MLdebug("created allocator");
 }
@@ -20,54 +71,285 @@ ValueAllocator::ValueAllocator ()
 
 ValueAllocator::~ValueAllocator ()
 {
-	delete next;
-	delete[] slab;
+	for (auto list : { nursery_, partial_, full_ })
+		while (list)
+		{
+			auto s = list;
+			list = s->next;
+
+			for (int i = 0; i < s->bump; i++)
+			{
+				auto v = s->values() + i;
+				if (v->allocator == this)
+				{
+					// don't call back into destroyed()
+					v->allocator = nullptr;
+					v->destroy();
+				}
+			}
+			unmapSlab(s, slabBytes_);
+		}
+
+	while (spare_)
+	{
+		auto s = spare_;
+		spare_ = s->next;
+		unmapSlab(s, slabBytes_);
+	}
+}
+
+
+void ValueAllocator::link_ (Slab*& list, Slab* s)
+{
+	s->prev = nullptr;
+	s->next = list;
+	s->list = &list;
+	if (list)
+		list->prev = s;
+	list = s;
+}
+void ValueAllocator::unlink_ (Slab* s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		*s->list = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
 }
 
 
-Value* ValueAllocator::alloc (Value::Type t, Context* ctx)
+ValueAllocator::Slab* ValueAllocator::newSlab_ ()
 {
-	int pos = NumValues;
-	int search = 0;
+	Slab* s;
 
-	for (int i = left; i < NumValues; i++)
+	if (spare_)
 	{
-		left++;
-		if (slab[i].allocator == nullptr)
-		{
-			pos = i;
-			break;
-		}
-		else
-			search++;
+		s = spare_;
+		spare_ = s->next;
+		numSpare_--;
+	}
+	else
+	{
+		s = (Slab*) mapSlab(slabBytes_);
+		if (s == nullptr)
+			throw std::bad_alloc();
+		numSlabs_++;
+	}
+
+	s->free = nullptr;
+	s->live = 0;
+	s->bump = 0;
+	return s;
+}
+ValueAllocator::Slab* ValueAllocator::nurserySlab_ ()
+{
+	Slab* s;
+
+	// prefer fresh slabs, which can be bumped through, over
+	// recycling the holes in the old generation
+	if (spare_ == nullptr && partial_ != nullptr)
+	{
+		s = partial_;
+		unlink_(s);
 	}
+	else
+		s = newSlab_();
 
-	if (pos >= NumValues)
+	link_(nursery_, s);
+	return s;
+}
+void ValueAllocator::freeSlab_ (Slab* s)
+{
+	// keep what will be needed to refill the nursery
+	if (numSpare_ * slabValues_ < nurserySize_)
+	{
+		s->next = spare_;
+		spare_ = s;
+		numSpare_++;
+	}
+	else
+	{
+		unmapSlab(s, slabBytes_);
+		numSlabs_--;
+	}
+}
+
+
+Value* ValueAllocator::alloc (Value::Type t)
+{
+	Slab* s = nursery_;
+	Value* out;
+
+	for (;;)
 	{
-		if (next == nullptr)
-			next = new ValueAllocator();
-		
-		return next->alloc(t, ctx);
+		if (s != nullptr)
+		{
+			if (s->bump < slabValues_)
+			{
+				out = s->values() + s->bump++;
+				break;
+			}
+			if (s->free != nullptr)
+			{
+				out = s->free;
+				s->free = out->nextFree_;
+				break;
+			}
+		}
+		s = nurserySlab_();
 	}
 
-	Value* out = slab + pos;
-	out->type = t;
-	out->owner = ctx;
+	s->live++;
+	young_++;
+	new (out) Value(t);
 	out->allocator = this;
 	return out;
 }
 
 void ValueAllocator::destroyed (Value* v)
 {
-	int pos = v - slab;
+	Slab* s = slabOf_(v);
+
+	if (v->old)
+		old_--;
+	else
+		young_--;
+
+	v->nextFree_ = s->free;
+	s->free = v;
 
-	if (pos < 0 || pos >= NumValues) return; // not in slab?!
+	// nursery slabs stay put until the next sweep
+	if (s->list == &nursery_)
+	{
+		s->live--;
+		return;
+	}
 
-	if (pos < left)
-		left = pos;
+	if (s->live-- == slabValues_)
+	{
+		unlink_(s);
+		link_(partial_, s);
+	}
 
-	v->allocator = nullptr;
+	if (s->live == 0)
+	{
+		unlink_(s);
+		freeSlab_(s);
+	}
+}
+
+
+// move a swept slab to the list it belongs in now
+void ValueAllocator::retire_ (Slab* s, Slab*& empty)
+{
+	unlink_(s);
+
+	if (s->live == 0)
+	{
+		s->next = empty;
+		empty = s;
+	}
+	else if (s->live == slabValues_)
+		link_(full_, s);
+	else
+		link_(partial_, s);
+}
+
+
+int ValueAllocator::sweep ()
+{
+	int freed = 0;
+	Slab* empty = nullptr; // released once the new threshold is known
+
+	for (auto list : { nursery_, partial_, full_ })
+		while (list)
+		{
+			auto s = list;
+			list = s->next;
+
+			for (int i = 0; i < s->bump; i++)
+			{
+				auto v = s->values() + i;
+				if (v->allocator != this)
+					continue;
+
+				if (v->marked)
+				{
+					v->marked = false;
+					v->old = true;
+					continue;
+				}
+
+				v->finalize();
+				v->allocator = nullptr;
+				v->nextFree_ = s->free;
+				s->free = v;
+				s->live--;
+				freed++;
+			}
+
+			retire_(s, empty);
+		}
+
+	old_ = old_ + young_ - freed;
+	young_ = 0;
+	threshold_ = old_ * 2;
+	if (threshold_ < MinCollectThreshold)
+		threshold_ = MinCollectThreshold;
+
+	while (empty)
+	{
+		auto s = empty;
+		empty = s->next;
+		freeSlab_(s);
+	}
+	return freed;
+}
+
+int ValueAllocator::sweepYoung ()
+{
+	int freed = 0;
+	Slab* empty = nullptr;
+
+	while (nursery_)
+	{
+		auto s = nursery_;
+
+		for (int i = 0; i < s->bump; i++)
+		{
+			auto v = s->values() + i;
+			if (v->allocator != this || v->old)
+				continue;
+
+			if (v->marked)
+			{
+				v->marked = false;
+				v->old = true;
+				continue;
+			}
+
+			v->finalize();
+			v->allocator = nullptr;
+			v->nextFree_ = s->free;
+			s->free = v;
+			s->live--;
+			freed++;
+		}
+
+		retire_(s, empty);
+	}
+
+	old_ += young_ - freed;
+	young_ = 0;
+
+	while (empty)
+	{
+		auto s = empty;
+		empty = s->next;
+		freeSlab_(s);
+	}
+	return freed;
 }
 
-#endif
 };
@@ -1,27 +1,96 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
 #include "Value.h"
 
 namespace ml {
 
-class Context;
-
+/*
+ * Hands out Values from fixed size slabs.
+ *
+ * Values are allocated young, by bumping through the slabs of the
+ * nursery (falling back on their free lists when a slab has been
+ * recycled). A minor collection only marks and sweeps the nursery;
+ * the Values that survive it are promoted in place and their slabs
+ * join the old generation. Old slabs keep an intrusive free list of
+ * their dead Values and are only swept by a full collection.
+ *
+ * Slabs are aligned to their own size, which lets destroyed() find
+ * the slab of a Value by masking its address. Slabs that become
+ * empty are handed back to the OS, except for enough spares to
+ * refill the nursery without mapping new ones.
+ *
+ * The allocator does not know about roots; the collector in
+ * Context marks live Values and then calls sweep()/sweepYoung().
+ */
 class ValueAllocator
 {
 public:
 	enum
 	{
-		NumValues = 128
+		DefaultSlabSize = 256,
+		DefaultNurserySize = 8192,
+		MinCollectThreshold = 16384
 	};
-	ValueAllocator ();
+	ValueAllocator (int slabSize = DefaultSlabSize,
+					int nurserySize = DefaultNurserySize);
 	~ValueAllocator ();
 
-	Value* alloc (Value::Type type = Value::Type::Void,
-						Context* ctx = nullptr);
+	Value* alloc (Value::Type type = Value::Type::Void);
 	void destroyed (Value* v);
+
+	// destroy unmarked Values and unmark (and promote) the rest,
+	// returns the number of Values destroyed
+	int sweep ();
+	// same, but only for young Values
+	int sweepYoung ();
+
+	inline bool wantsCollect () const { return old_ >= threshold_; }
+	inline bool wantsCollectYoung () const { return young_ >= nurserySize_; }
+
+	inline int live () const { return young_ + old_; }
+	inline int slabSize () const { return slabValues_; }
+	inline int numSlabs () const { return numSlabs_; }
 private:
-	Value* slab;
-	int left;
-	ValueAllocator* next;
+	struct Slab
+	{
+		Slab* prev;
+		Slab* next;
+		Slab** list; // list this slab is linked in
+		Value* free;
+		int live;
+		int bump;
+
+		inline Value* values ()
+		{ return reinterpret_cast<Value*>(this + 1); }
+	};
+
+	std::size_t slabBytes_;
+	int slabValues_;
+	int numSlabs_;
+	int nurserySize_;
+	int young_;
+	int old_;
+	int threshold_; // full collection when old_ reaches this
+
+	Slab* nursery_; // slabs young Values are allocated in, newest first
+	Slab* partial_; // old slabs with room left
+	Slab* full_;
+	Slab* spare_;   // empty slabs kept instead of unmapping
+	int numSpare_;
+
+	Slab* newSlab_ ();
+	Slab* nurserySlab_ ();
+	void freeSlab_ (Slab* s);
+	void retire_ (Slab* s, Slab*& empty);
+	inline Slab* slabOf_ (Value* v) const
+	{
+		return reinterpret_cast<Slab*>(
+			reinterpret_cast<std::uintptr_t>(v) & ~(slabBytes_ - 1));
+	}
+
+	static void link_ (Slab*& list, Slab* s);
+	static void unlink_ (Slab* s);
 };
 
 };
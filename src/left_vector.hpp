@@ -15,7 +15,7 @@ class left_vector
 public:
 	inline ~left_vector ()
 	{
-		delete buf_;
+		delete[] buf_;
 	}
 
 	inline left_vector ()
@@ -81,6 +81,8 @@ public:
 		front() = value;
 	}
 	inline void pop_front () { size_--; }
+	// keeps the buffer, for reuse
+	inline void clear () { size_ = 0; }
 	inline T& front () { return buf_[cap_ - size_]; }
 
 	inline T& operator[] (int i) { return buf_ + (cap_ - size_ + i); }
@@ -2,11 +2,41 @@
 #include "ML.h"
 
 
-int main ()
+int main (int argc, char** argv)
 {
 	ml::Error err;
 	ml::Lexer lex;
 	ml::Token tok;
+	std::string emitPath;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string opt(argv[i]);
+
+		if (opt == "--vm")
+			ml::Bytecode::enabled = true;
+		else if (opt == "--stack-limit" && i + 1 < argc)
+			ml::Bytecode::stackLimit = std::stoul(argv[++i]);
+		else if (opt == "--no-optimize")
+			ml::Exp::optimizing = false;
+		else if (opt == "--dump-ast")
+			ml::Exp::dumping = true;
+		else if (opt == "--no-types")
+			ml::Types::enabled = false;
+		else if (opt == "--no-jit")
+			ml::Jit::enabled = false;
+		else if (opt == "--parallel" && i + 1 < argc)
+			ml::Jit::workers = std::stoi(argv[++i]);
+		else if (opt == "--emit-cpp" && i + 1 < argc)
+			emitPath = argv[++i];
+		else if (opt == "--stats")
+			ml::Stats::enabled = true;
+		else
+		{
+			std::cerr << "unknown option '" << opt << "'" << std::endl;
+			return -1;
+		}
+	}
 	
 	if (!lex.open("test.txt", err))
 		goto fail;
@@ -20,6 +50,14 @@ int main ()
 		
 		if (!parser.parseEnvironment(&ctx, false, err))
 			goto fail;
+
+		// compile instead of running
+		if (!emitPath.empty())
+		{
+			if (!ml::Aot::emit(emitPath, parser.definitions(), &ctx, err))
+				goto fail;
+			return 0;
+		}
 		
 		
 		if (!ctx.env()->get(mainFunc, "main"))
@@ -28,11 +66,14 @@ int main ()
 			goto fail;
 		}
 		
-		if (!mainFunc->eval(output, &ctx, err))
+		if (!ml::Value::eval(output, &ctx, mainFunc, err))
 			goto fail;
 		
-		std::cout << "result: " << output->str() << std::endl;
+		std::cout << "result: " << ml::Value::str(output) << std::endl;
 	}
+
+	if (ml::Stats::enabled)
+		ml::Stats::dump(std::cerr);
 	
 	return 0;
 fail: